@@ -12,12 +12,22 @@
 //./crack 1 5 na3C5487Wz4zw
 //
 //Should return the password 'apple'
+//
+//<target> can be a traditional DES hash (two salt characters, then the hash) or a
+//"$id$salt$hash" string from crypt(). MD5-crypt ($1$), SHA-256-crypt ($5$, $5$rounds=N$)
+//and SHA-512-crypt ($6$) hashes are checked a whole batch of candidates at a time by
+//the multi-buffer kernels in mbcrypt.c (checked against crypt_r() before the search
+//starts); DES and any other format crypt() supports go through crypt_r().
+//
+//Build with:
+//gcc -O2 -pthread -o crack crack.c mbcrypt.c -lcrypt
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>  
 #include <pthread.h>
 #include <crypt.h>
+#include "mbcrypt.h"
 
 
 #define USAGE "crack <threads> <keysize> <target> <enable special characters>(optional)"
@@ -31,11 +41,13 @@ struct PassData {
   int curThread; 
   int keysize;
   char* target; 
-  char salt[3];
+  char* setting;
+  struct MbCrypt* mb;   // Multi-buffer engine for this thread, NULL to use crypt_r()
 };
 
 void* cracker(void* args);
-void checkCombinations(char start, int length, char* target, char* salt, char begin, char end);
+void checkCombinations(char start, int length, char* target, char* setting, char begin, char end, struct MbCrypt* mb);
+int engineMatchesCrypt(struct MbCrypt* mb, char* setting, int keysize);
 
 int main(int argc, char* argv[]) {
 
@@ -94,9 +106,29 @@ int main(int argc, char* argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    char salt[3];
-    memcpy(salt, target, 2);
-    salt[2] = '\0';
+    // The setting crypt() takes: the "$id$salt" part for the formats with multi-buffer kernels,
+    // the whole hash for other "$id$" formats and the two salt characters for DES
+    char* setting;
+    struct MbCrypt* probe = mbCryptCreate(target);
+    if (probe != NULL) {
+      setting = strndup(target, strrchr(target, '$') - target);
+    }
+    else if (target[0] == '$') {
+      setting = strdup(target);
+    }
+    else {
+      setting = strndup(target, 2);
+    }
+    if (setting == NULL) {
+      printf("Error: Unable to Allocate Memory\n");
+      exit(EXIT_FAILURE);
+    }
+    // Only trust the kernels with the search if they give what crypt_r() does for this setting
+    int use_engine = probe != NULL && engineMatchesCrypt(probe, setting, keysize);
+    if (probe != NULL && !use_engine) {
+      printf("Warning: Multi-buffer %s kernel disagrees with crypt() for this hash, using crypt_r()\n", mbCryptKernel());
+    }
+    mbCryptFree(probe);
 
     pthread_t threads[thread_count];
     struct PassData thread_data[thread_count];
@@ -107,7 +139,12 @@ int main(int argc, char* argv[]) {
       thread_data[i].curThread = i;
       thread_data[i].keysize = keysize;
       thread_data[i].target = target;
-      strcpy(thread_data[i].salt, salt);
+      thread_data[i].setting = setting;
+      thread_data[i].mb = use_engine ? mbCryptCreate(setting) : NULL;
+      if (use_engine && thread_data[i].mb == NULL) {
+        printf("Error: Unable to Allocate Memory\n");
+        exit(EXIT_FAILURE);
+      }
 
       pthread_create(&threads[i], NULL, cracker, (void*)&thread_data[i]);
 
@@ -116,7 +153,9 @@ int main(int argc, char* argv[]) {
     // Wait for all threads to finish executing
     for(int i = 0; i < thread_count; i++) {
       pthread_join(threads[i], NULL);
+      mbCryptFree(thread_data[i].mb);
     }
+    free(setting);
 
     return 0;
 }
@@ -144,38 +183,72 @@ void* cracker(void* args) {
   // Letters are split based on thread number and increment by total number of threads 
   // This ensures no overlap while also allowing # of threads that do not evenly divide 26
   for(int cindex = data->curThread; cindex < range; cindex += data->threadCount) {
-    checkCombinations(start + cindex, data->keysize, data->target, data->salt, start, end);
+    checkCombinations(start + cindex, data->keysize, data->target, data->setting, start, end, data->mb);
     if(found != 0) {
       break;
     }
   }
+  return NULL;
 }
 
 
-void checkCombinations(char start, int length, char* target, char* salt, char begin, char end) {
-  char curCombination[length];
+// Hash a batch of candidates, all at once with the multi-buffer engine or one by one with
+// crypt_r(), and report the one matching the target (returns 1 if there was one)
+int checkBatch(int count, int length, char batch[][length + 1], char* target, char* setting, struct MbCrypt* mb) {
+  struct crypt_data cdata;
+  cdata.initialized = 0;
+
+  if (mb == NULL) {
+    for(int i = 0; i < count; i++) {
+      char *hash = crypt_r(batch[i], setting, &cdata);
+      if(hash != NULL && strcmp(hash, target) == 0) {
+        printf("Found match: %s\n", batch[i]);
+        return 1;
+      }
+    }
+    return 0;
+  }
+
+  // A short final batch is padded out with its last candidate
+  int lanes = mbCryptLanes(mb);
+  const char* keys[MB_MAXLANES];
+  char hashes[MB_MAXLANES][MB_HASHLEN];
+  for(int i = 0; i < lanes; i++) {
+    keys[i] = batch[i < count ? i : count - 1];
+  }
+  mbCrypt(mb, keys, length, hashes);
+  for(int i = 0; i < count; i++) {
+    if(strcmp(hashes[i], target) == 0) {
+      // Confirm with crypt() itself before reporting it
+      char *hash = crypt_r(batch[i], setting, &cdata);
+      if(hash != NULL && strcmp(hash, target) == 0) {
+        printf("Found match: %s\n", batch[i]);
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+
+void checkCombinations(char start, int length, char* target, char* setting, char begin, char end, struct MbCrypt* mb) {
+  char curCombination[length + 1];
   curCombination[0] = start;    // Set starting letter 
+  curCombination[length] = '\0';
 
   // Set all other letters to 'a'
   for(int i = 1; i < length; i++) {
     curCombination[i] = begin;
   }
+  // Candidates are hashed in batches of as many as the engine takes at once
+  int lanes = mb != NULL ? mbCryptLanes(mb) : 1;
+  char batch[lanes][length + 1];
+  int count = 0;
+  int more = 1;
+
   // Iterate through all possible combinations from index 1 -> length-1 
-  while(1) {
-    struct crypt_data cdata;
-    cdata.initialized = 0;
-
-    char *hash = crypt_r(curCombination, salt, &cdata);
-    if(strcmp(hash, target) == 0) {
-      printf("Found match: %s\n", curCombination);
-      found = 1;
-      return;
-    }
-    // Observe from other threads if anything has been found
-    // Very useful to ensure program returns quickly when all special characters are enabled
-    if(found == 1) {
-      return;
-    }
+  while(more) {
+    memcpy(batch[count++], curCombination, length + 1);
 
     int position = length - 1; // Start at the last letter
     while(position >= 0) {
@@ -189,9 +262,47 @@ void checkCombinations(char start, int length, char* target, char* salt, char be
         position--; 
       }
     }
-    if(position < 1) {  // Do not generate any further combinations
-      printf("Found no match in %c\n", start);
-      break; 
+    more = position >= 1;  // Do not generate any further combinations
+
+    if(count == lanes || !more) {
+      if(checkBatch(count, length, batch, target, setting, mb)) {
+        found = 1;
+        return;
+      }
+      count = 0;
+    }
+    // Observe from other threads if anything has been found
+    // Very useful to ensure program returns quickly when all special characters are enabled
+    if(found == 1) {
+      return;
     }
   }
-}
\ No newline at end of file
+  printf("Found no match in %c\n", start);
+}
+
+
+// Hash a batch of sample keys of the search length with the engine and compare each with crypt_r()
+int engineMatchesCrypt(struct MbCrypt* mb, char* setting, int keysize) {
+  int lanes = mbCryptLanes(mb);
+  char samples[MB_MAXLANES][keysize + 1];
+  const char* keys[MB_MAXLANES];
+  char hashes[MB_MAXLANES][MB_HASHLEN];
+  for(int i = 0; i < lanes; i++) {
+    for(int j = 0; j < keysize; j++) {
+      samples[i][j] = '!' + (i * 31 + j * 7) % 94;
+    }
+    samples[i][keysize] = '\0';
+    keys[i] = samples[i];
+  }
+  mbCrypt(mb, keys, keysize, hashes);
+
+  struct crypt_data cdata;
+  cdata.initialized = 0;
+  for(int i = 0; i < lanes; i++) {
+    char *hash = crypt_r(samples[i], setting, &cdata);
+    if(hash == NULL || strcmp(hash, hashes[i]) != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
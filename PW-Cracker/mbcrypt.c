@@ -0,0 +1,821 @@
+//MBCRYPT - Multi-buffer MD5-crypt, SHA-256-crypt and SHA-512-crypt (see mbcrypt.h for the API)
+//
+//All three formats spend nearly all their time in a loop of rounds (1000 for MD5-crypt,
+//5000 by default for SHA-crypt), each hashing a short message made from the previous
+//digest, the password and the salt. Passwords of the same length give messages with the
+//same layout, so a batch of them goes through the loop together: every hash word is a
+//64-byte vector holding that word for each candidate (16 lanes of 32-bit words for MD5
+//and SHA-256, 8 lanes of 64-bit words for SHA-512). Which pieces make up a round's
+//message only depends on the round number modulo 2, 3 and 7, so each batch starts by
+//laying out the 42 possible messages once, and a round just shifts the previous digest
+//into the right one.
+//
+//The kernels are written once with GCC vector extensions and compiled three times, for
+//AVX-512F (the whole batch per instruction), AVX2 (8 or 4 candidates per instruction)
+//and the baseline (4 or 2 per SSE2 instruction on x86-64). The one the CPU supports is
+//picked at startup.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "mbcrypt.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MB_X86 1
+#endif
+
+typedef uint32_t v32 __attribute__((vector_size(64)));
+typedef uint64_t v64 __attribute__((vector_size(64)));
+
+#define VARIANTS 42                       // Distinct round messages (rounds repeat them modulo 2 * 3 * 7)
+#define VARIANT_BLOCKS 2                  // Blocks the longest round message takes (key of MB_MAXKEY)
+#define SETUP_MAX (MB_MAXKEY * MB_MAXKEY) // Longest message hashed before the rounds (the key key_len times)
+#define SALT_REPEAT_MAX (16 + 255)        // Most times SHA-crypt hashes the salt for its S sequence
+
+#define ALG_MD5 0
+#define ALG_SHA256 1
+#define ALG_SHA512 2
+
+#define ROTL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define ROTR64(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+#define ALWAYS_INLINE static inline __attribute__((always_inline))
+
+struct Algorithm {
+    int type;
+    char id;                      // Character between the leading '$'s of the setting
+    int word;                     // Bytes per hash word
+    int big_endian;
+    int block;                    // Bytes per block (the message length in bits takes the last block / 8)
+    int digest;                   // Bytes of digest
+    int lanes;
+    size_t max_salt;
+    unsigned long rounds;         // Rounds when the setting doesn't give them
+    const unsigned char* order;   // Digest bytes in the order they are encoded, 3 bytes to 4 characters
+    int triples;
+    int tail[3];                  // Bytes of the last, shorter group (-1 for a zero byte)
+    int tail_chars;
+};
+
+static const unsigned char md5_order[] = {
+    0, 6, 12,  1, 7, 13,  2, 8, 14,  3, 9, 15,  4, 10, 5
+};
+static const unsigned char sha256_order[] = {
+    0, 10, 20,  21, 1, 11,  12, 22, 2,  3, 13, 23,  24, 4, 14,
+    15, 25, 5,  6, 16, 26,  27, 7, 17,  18, 28, 8,  9, 19, 29
+};
+static const unsigned char sha512_order[] = {
+    0, 21, 42,  22, 43, 1,  44, 2, 23,  3, 24, 45,  25, 46, 4,  47, 5, 26,  6, 27, 48,
+    28, 49, 7,  50, 8, 29,  9, 30, 51,  31, 52, 10,  53, 11, 32,  12, 33, 54,  34, 55, 13,
+    56, 14, 35,  15, 36, 57,  37, 58, 16,  59, 17, 38,  18, 39, 60,  40, 61, 19,  62, 20, 41
+};
+
+static const struct Algorithm algorithms[] = {
+    { ALG_MD5, '1', 4, 0, 64, 16, 16, 8, 1000, md5_order, 5, { -1, -1, 11 }, 2 },
+    { ALG_SHA256, '5', 4, 1, 64, 32, 16, 16, 5000, sha256_order, 10, { -1, 31, 30 }, 3 },
+    { ALG_SHA512, '6', 8, 1, 128, 64, 8, 16, 5000, sha512_order, 21, { -1, -1, 63 }, 2 },
+};
+
+static const char itoa64[] = "./0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+
+static const uint32_t md5_iv[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+static const uint32_t sha256_iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+static const uint64_t sha512_iv[8] = {
+    0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+    0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+static const uint32_t md5_k[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+static const int md5_r[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20, 5, 9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint64_t sha512_k[80] = {
+    0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+    0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+    0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+    0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+    0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+    0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+    0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+    0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+    0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+    0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+    0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+    0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+    0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+    0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+    0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+    0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+    0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+    0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+    0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+    0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL,
+};
+
+// Message words for all lanes: one block for the setup hashes, up to VARIANT_BLOCKS for a round
+union Words {
+    v32 w32[VARIANT_BLOCKS * 16];
+    v64 w64[VARIANT_BLOCKS * 16];
+};
+
+union State {
+    v32 w32[8];
+    v64 w64[8];
+};
+
+struct MbCrypt {
+    union Words tmpl[VARIANTS];     // Round messages with the digest bytes left zero
+    union Words edge[VARIANTS];     // The template words the digest lands in, to reset them each round
+    int tmpl_blocks[VARIANTS];
+    size_t tmpl_off[VARIANTS];      // Byte offset of the previous digest in each round message
+    size_t key_len;                 // Key length the layout above is for (0 before the first batch)
+    const struct Algorithm* alg;
+    char salt[17];
+    size_t salt_len;
+    unsigned long rounds;
+    int rounds_custom;
+    unsigned char s_seq[256][16];   // SHA-crypt S sequence for each possible first byte of the A digest
+};
+
+
+// Compression functions, written once for all lanes and instantiated per instruction set below
+
+ALWAYS_INLINE void md5_body(v32* state, const v32* m) {
+    v32 a = state[0];
+    v32 b = state[1];
+    v32 c = state[2];
+    v32 d = state[3];
+#pragma GCC unroll 64
+    for (int i = 0; i < 64; i++) {
+        v32 f;
+        int g;
+        if (i < 16) {
+            f = d ^ (b & (c ^ d));
+            g = i;
+        }
+        else if (i < 32) {
+            f = c ^ (d & (b ^ c));
+            g = (5 * i + 1) & 15;
+        }
+        else if (i < 48) {
+            f = b ^ c ^ d;
+            g = (3 * i + 5) & 15;
+        }
+        else {
+            f = c ^ (b | ~d);
+            g = (7 * i) & 15;
+        }
+        f += a + md5_k[i] + m[g];
+        a = d;
+        d = c;
+        c = b;
+        b += ROTL32(f, md5_r[i]);
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+}
+
+ALWAYS_INLINE void sha256_body(v32* state, const v32* m) {
+    v32 w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = m[i];
+    }
+    for (int i = 16; i < 64; i++) {
+        v32 s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        v32 s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    v32 a = state[0], b = state[1], c = state[2], d = state[3];
+    v32 e = state[4], f = state[5], g = state[6], h = state[7];
+#pragma GCC unroll 64
+    for (int i = 0; i < 64; i++) {
+        v32 t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + (g ^ (e & (f ^ g))) + sha256_k[i] + w[i];
+        v32 t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) | (c & (a | b)));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+ALWAYS_INLINE void sha512_body(v64* state, const v64* m) {
+    v64 w[80];
+    for (int i = 0; i < 16; i++) {
+        w[i] = m[i];
+    }
+    for (int i = 16; i < 80; i++) {
+        v64 s0 = ROTR64(w[i - 15], 1) ^ ROTR64(w[i - 15], 8) ^ (w[i - 15] >> 7);
+        v64 s1 = ROTR64(w[i - 2], 19) ^ ROTR64(w[i - 2], 61) ^ (w[i - 2] >> 6);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    v64 a = state[0], b = state[1], c = state[2], d = state[3];
+    v64 e = state[4], f = state[5], g = state[6], h = state[7];
+#pragma GCC unroll 80
+    for (int i = 0; i < 80; i++) {
+        v64 t1 = h + (ROTR64(e, 14) ^ ROTR64(e, 18) ^ ROTR64(e, 41)) + (g ^ (e & (f ^ g))) + sha512_k[i] + w[i];
+        v64 t2 = (ROTR64(a, 28) ^ ROTR64(a, 34) ^ ROTR64(a, 39)) + ((a & b) | (c & (a | b)));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+
+// The round loops. The previous digest goes in at tmpl_off: the words it covers are reset
+// from edge and the digest is shifted into them, which leaves the rest of the template alone.
+
+ALWAYS_INLINE void md5_rounds_body(struct MbCrypt* mb, v32* digest) {
+    for (unsigned long r = 0; r < mb->rounds; r++) {
+        int v = r % VARIANTS;
+        v32* m = mb->tmpl[v].w32;
+        const v32* edge = mb->edge[v].w32;
+        size_t w = mb->tmpl_off[v] / 4;
+        int s = (mb->tmpl_off[v] % 4) * 8;
+        for (int k = 0; k <= 4; k++) {
+            m[w + k] = edge[k];
+        }
+        // Little-endian words: the first digest byte lands s bits up
+        for (int k = 0; k < 4; k++) {
+            if (s == 0) {
+                m[w + k] |= digest[k];
+            }
+            else {
+                m[w + k] |= digest[k] << s;
+                m[w + k + 1] |= digest[k] >> (32 - s);
+            }
+        }
+        v32 state[4];
+        for (int i = 0; i < 4; i++) {
+            state[i] = (v32){ 0 } + md5_iv[i];
+        }
+        for (int b = 0; b < mb->tmpl_blocks[v]; b++) {
+            md5_body(state, m + 16 * b);
+        }
+        for (int i = 0; i < 4; i++) {
+            digest[i] = state[i];
+        }
+    }
+}
+
+ALWAYS_INLINE void sha256_rounds_body(struct MbCrypt* mb, v32* digest) {
+    for (unsigned long r = 0; r < mb->rounds; r++) {
+        int v = r % VARIANTS;
+        v32* m = mb->tmpl[v].w32;
+        const v32* edge = mb->edge[v].w32;
+        size_t w = mb->tmpl_off[v] / 4;
+        int s = (mb->tmpl_off[v] % 4) * 8;
+        for (int k = 0; k <= 8; k++) {
+            m[w + k] = edge[k];
+        }
+        // Big-endian words: the first digest byte lands s bits down
+        for (int k = 0; k < 8; k++) {
+            if (s == 0) {
+                m[w + k] |= digest[k];
+            }
+            else {
+                m[w + k] |= digest[k] >> s;
+                m[w + k + 1] |= digest[k] << (32 - s);
+            }
+        }
+        v32 state[8];
+        for (int i = 0; i < 8; i++) {
+            state[i] = (v32){ 0 } + sha256_iv[i];
+        }
+        for (int b = 0; b < mb->tmpl_blocks[v]; b++) {
+            sha256_body(state, m + 16 * b);
+        }
+        for (int i = 0; i < 8; i++) {
+            digest[i] = state[i];
+        }
+    }
+}
+
+ALWAYS_INLINE void sha512_rounds_body(struct MbCrypt* mb, v64* digest) {
+    for (unsigned long r = 0; r < mb->rounds; r++) {
+        int v = r % VARIANTS;
+        v64* m = mb->tmpl[v].w64;
+        const v64* edge = mb->edge[v].w64;
+        size_t w = mb->tmpl_off[v] / 8;
+        int s = (mb->tmpl_off[v] % 8) * 8;
+        for (int k = 0; k <= 8; k++) {
+            m[w + k] = edge[k];
+        }
+        for (int k = 0; k < 8; k++) {
+            if (s == 0) {
+                m[w + k] |= digest[k];
+            }
+            else {
+                m[w + k] |= digest[k] >> s;
+                m[w + k + 1] |= digest[k] << (64 - s);
+            }
+        }
+        v64 state[8];
+        for (int i = 0; i < 8; i++) {
+            state[i] = (v64){ 0 } + sha512_iv[i];
+        }
+        for (int b = 0; b < mb->tmpl_blocks[v]; b++) {
+            sha512_body(state, m + 16 * b);
+        }
+        for (int i = 0; i < 8; i++) {
+            digest[i] = state[i];
+        }
+    }
+}
+
+#define DEFINE_KERNELS(isa, attr) \
+    attr static void md5_compress_##isa(v32* state, const v32* m) { md5_body(state, m); } \
+    attr static void sha256_compress_##isa(v32* state, const v32* m) { sha256_body(state, m); } \
+    attr static void sha512_compress_##isa(v64* state, const v64* m) { sha512_body(state, m); } \
+    attr static void md5_rounds_##isa(struct MbCrypt* mb, v32* d) { md5_rounds_body(mb, d); } \
+    attr static void sha256_rounds_##isa(struct MbCrypt* mb, v32* d) { sha256_rounds_body(mb, d); } \
+    attr static void sha512_rounds_##isa(struct MbCrypt* mb, v64* d) { sha512_rounds_body(mb, d); }
+
+DEFINE_KERNELS(generic, )
+#ifdef MB_X86
+DEFINE_KERNELS(avx2, __attribute__((target("avx2"))))
+DEFINE_KERNELS(avx512, __attribute__((target("avx512f"))))
+#endif
+
+// Kernels in use, chosen once by selectKernels()
+static const char* kernel_name = "generic";
+static void (*md5_compress)(v32*, const v32*) = md5_compress_generic;
+static void (*sha256_compress)(v32*, const v32*) = sha256_compress_generic;
+static void (*sha512_compress)(v64*, const v64*) = sha512_compress_generic;
+static void (*md5_rounds)(struct MbCrypt*, v32*) = md5_rounds_generic;
+static void (*sha256_rounds)(struct MbCrypt*, v32*) = sha256_rounds_generic;
+static void (*sha512_rounds)(struct MbCrypt*, v64*) = sha512_rounds_generic;
+
+static void selectKernels(void) {
+#ifdef MB_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        kernel_name = "avx512f";
+        md5_compress = md5_compress_avx512;
+        sha256_compress = sha256_compress_avx512;
+        sha512_compress = sha512_compress_avx512;
+        md5_rounds = md5_rounds_avx512;
+        sha256_rounds = sha256_rounds_avx512;
+        sha512_rounds = sha512_rounds_avx512;
+    }
+    else if (__builtin_cpu_supports("avx2")) {
+        kernel_name = "avx2";
+        md5_compress = md5_compress_avx2;
+        sha256_compress = sha256_compress_avx2;
+        sha512_compress = sha512_compress_avx2;
+        md5_rounds = md5_rounds_avx2;
+        sha256_rounds = sha256_rounds_avx2;
+        sha512_rounds = sha512_rounds_avx2;
+    }
+#endif
+}
+
+
+// Moving bytes in and out of the lanes
+
+static void putWord(const struct Algorithm* alg, union Words* words, int j, int lane, const unsigned char* p) {
+    uint64_t x = 0;
+    for (int i = 0; i < alg->word; i++) {
+        x |= (uint64_t)p[i] << (alg->big_endian ? 8 * (alg->word - 1 - i) : 8 * i);
+    }
+    if (alg->word == 8) {
+        words->w64[j][lane] = x;
+    }
+    else {
+        words->w32[j][lane] = (uint32_t)x;
+    }
+}
+
+static void getDigest(const struct Algorithm* alg, const union State* state, int lane, unsigned char* out) {
+    for (int j = 0; j < alg->digest / alg->word; j++) {
+        uint64_t x = alg->word == 8 ? state->w64[j][lane] : state->w32[j][lane];
+        for (int i = 0; i < alg->word; i++) {
+            out[j * alg->word + i] = x >> (alg->big_endian ? 8 * (alg->word - 1 - i) : 8 * i);
+        }
+    }
+}
+
+static size_t blockCount(const struct Algorithm* alg, size_t len) {
+    return (len + 1 + alg->block / 8 + alg->block - 1) / alg->block;
+}
+
+// Block b of msg, with the 0x80 byte and the bit count added the way the hash pads it
+static void padBlock(const struct Algorithm* alg, unsigned char* out, const unsigned char* msg, size_t len, size_t b) {
+    for (int i = 0; i < alg->block; i++) {
+        size_t pos = b * alg->block + i;
+        out[i] = pos < len ? msg[pos] : pos == len ? 0x80 : 0;
+    }
+    if (b == blockCount(alg, len) - 1) {
+        uint64_t bits = (uint64_t)len * 8;
+        for (int i = 0; i < 8; i++) {
+            if (alg->big_endian) {
+                out[alg->block - 1 - i] = bits >> (8 * i);
+            }
+            else {
+                out[alg->block - 8 + i] = bits >> (8 * i);
+            }
+        }
+    }
+}
+
+static void initState(const struct Algorithm* alg, union State* state) {
+    for (int i = 0; i < alg->digest / alg->word; i++) {
+        if (alg->type == ALG_MD5) {
+            state->w32[i] = (v32){ 0 } + md5_iv[i];
+        }
+        else if (alg->type == ALG_SHA256) {
+            state->w32[i] = (v32){ 0 } + sha256_iv[i];
+        }
+        else {
+            state->w64[i] = (v64){ 0 } + sha512_iv[i];
+        }
+    }
+}
+
+// Hash one message per lane, of any lengths: each lane's digest is taken after its own last block
+static void hashLanes(const struct Algorithm* alg, const unsigned char* const* msgs, const size_t* lens, unsigned char digests[][64]) {
+    size_t last[MB_MAXLANES];
+    size_t blocks = 0;
+    for (int lane = 0; lane < alg->lanes; lane++) {
+        last[lane] = blockCount(alg, lens[lane]) - 1;
+        if (last[lane] + 1 > blocks) {
+            blocks = last[lane] + 1;
+        }
+    }
+    union State state;
+    union Words words;
+    unsigned char bytes[128];
+    initState(alg, &state);
+    for (size_t b = 0; b < blocks; b++) {
+        for (int lane = 0; lane < alg->lanes; lane++) {
+            if (b <= last[lane]) {
+                padBlock(alg, bytes, msgs[lane], lens[lane], b);
+                for (int j = 0; j < 16; j++) {
+                    putWord(alg, &words, j, lane, bytes + j * alg->word);
+                }
+            }
+        }
+        if (alg->type == ALG_MD5) {
+            md5_compress(state.w32, words.w32);
+        }
+        else if (alg->type == ALG_SHA256) {
+            sha256_compress(state.w32, words.w32);
+        }
+        else {
+            sha512_compress(state.w64, words.w64);
+        }
+        for (int lane = 0; lane < alg->lanes; lane++) {
+            if (b == last[lane]) {
+                getDigest(alg, &state, lane, digests[lane]);
+            }
+        }
+    }
+}
+
+
+// Work out where the pieces of each round message go for keys of this length
+static void layoutRounds(struct MbCrypt* mb, size_t key_len) {
+    const struct Algorithm* alg = mb->alg;
+    for (int v = 0; v < VARIANTS; v++) {
+        size_t middle = (v % 3 ? mb->salt_len : 0) + (v % 7 ? key_len : 0);
+        mb->tmpl_off[v] = v & 1 ? key_len + middle : 0;
+        mb->tmpl_blocks[v] = blockCount(alg, alg->digest + middle + key_len);
+    }
+    mb->key_len = key_len;
+}
+
+// Fill in the round messages for this batch (P and S are the per-lane password and salt sequences)
+static void buildRounds(struct MbCrypt* mb, unsigned char p[][MB_MAXKEY], unsigned char s[][16]) {
+    const struct Algorithm* alg = mb->alg;
+    size_t k = mb->key_len;
+    unsigned char msg[VARIANT_BLOCKS * 128];
+    unsigned char bytes[128];
+    for (int v = 0; v < VARIANTS; v++) {
+        size_t edge_first = mb->tmpl_off[v] / alg->word;
+        for (int lane = 0; lane < alg->lanes; lane++) {
+            size_t len = 0;
+            if (v & 1) {
+                memcpy(msg + len, p[lane], k);
+                len += k;
+            }
+            else {
+                memset(msg + len, 0, alg->digest);
+                len += alg->digest;
+            }
+            if (v % 3) {
+                memcpy(msg + len, s[lane], mb->salt_len);
+                len += mb->salt_len;
+            }
+            if (v % 7) {
+                memcpy(msg + len, p[lane], k);
+                len += k;
+            }
+            if (v & 1) {
+                memset(msg + len, 0, alg->digest);
+                len += alg->digest;
+            }
+            else {
+                memcpy(msg + len, p[lane], k);
+                len += k;
+            }
+            for (int b = 0; b < mb->tmpl_blocks[v]; b++) {
+                padBlock(alg, bytes, msg, len, b);
+                for (int j = 0; j < 16; j++) {
+                    putWord(alg, &mb->tmpl[v], 16 * b + j, lane, bytes + j * alg->word);
+                }
+            }
+            for (int j = 0; j <= alg->digest / alg->word; j++) {
+                if (alg->word == 8) {
+                    mb->edge[v].w64[j][lane] = mb->tmpl[v].w64[edge_first + j][lane];
+                }
+                else {
+                    mb->edge[v].w32[j][lane] = mb->tmpl[v].w32[edge_first + j][lane];
+                }
+            }
+        }
+    }
+}
+
+// Everything before the rounds: the A digest that starts them, and the P and S sequences
+static void setupLanes(struct MbCrypt* mb, const char* const* keys, size_t k,
+                       unsigned char a[][64], unsigned char p[][MB_MAXKEY], unsigned char s[][16]) {
+    const struct Algorithm* alg = mb->alg;
+    const size_t d = alg->digest;
+    const int md5 = alg->type == ALG_MD5;
+    unsigned char buf[MB_MAXLANES][SETUP_MAX];
+    const unsigned char* msgs[MB_MAXLANES];
+    size_t lens[MB_MAXLANES];
+    unsigned char alt[MB_MAXLANES][64];
+
+    // B = H(key salt key)
+    for (int lane = 0; lane < alg->lanes; lane++) {
+        unsigned char* q = buf[lane];
+        memcpy(q, keys[lane], k);
+        memcpy(q + k, mb->salt, mb->salt_len);
+        memcpy(q + k + mb->salt_len, keys[lane], k);
+        msgs[lane] = buf[lane];
+        lens[lane] = 2 * k + mb->salt_len;
+    }
+    hashLanes(alg, msgs, lens, alt);
+
+    // A = H(key [magic] salt, B for each byte of the key, then one piece per bit of the key length)
+    for (int lane = 0; lane < alg->lanes; lane++) {
+        unsigned char* q = buf[lane];
+        memcpy(q, keys[lane], k);
+        q += k;
+        if (md5) {
+            memcpy(q, "$1$", 3);
+            q += 3;
+        }
+        memcpy(q, mb->salt, mb->salt_len);
+        q += mb->salt_len;
+        size_t cnt;
+        for (cnt = k; cnt > d; cnt -= d) {
+            memcpy(q, alt[lane], d);
+            q += d;
+        }
+        memcpy(q, alt[lane], cnt);
+        q += cnt;
+        for (cnt = k; cnt > 0; cnt >>= 1) {
+            if (md5) {
+                *q++ = cnt & 1 ? 0 : keys[lane][0];
+            }
+            else if (cnt & 1) {
+                memcpy(q, alt[lane], d);
+                q += d;
+            }
+            else {
+                memcpy(q, keys[lane], k);
+                q += k;
+            }
+        }
+        lens[lane] = q - buf[lane];
+    }
+    hashLanes(alg, msgs, lens, a);
+
+    if (md5) {
+        for (int lane = 0; lane < alg->lanes; lane++) {
+            memcpy(p[lane], keys[lane], k);
+            memcpy(s[lane], mb->salt, mb->salt_len);
+        }
+        return;
+    }
+    // P = H(key repeated key_len times) stretched to key_len, S from the table
+    for (int lane = 0; lane < alg->lanes; lane++) {
+        for (size_t i = 0; i < k; i++) {
+            memcpy(buf[lane] + i * k, keys[lane], k);
+        }
+        lens[lane] = k * k;
+    }
+    hashLanes(alg, msgs, lens, alt);
+    for (int lane = 0; lane < alg->lanes; lane++) {
+        for (size_t i = 0; i < k; i++) {
+            p[lane][i] = alt[lane][i % d];
+        }
+        memcpy(s[lane], mb->s_seq[a[lane][0]], mb->salt_len);
+    }
+}
+
+static char* b64(char* out, uint32_t w, int n) {
+    while (n-- > 0) {
+        *out++ = itoa64[w & 0x3f];
+        w >>= 6;
+    }
+    return out;
+}
+
+static void encodeHash(const struct MbCrypt* mb, const unsigned char* d, char* out) {
+    const struct Algorithm* alg = mb->alg;
+    char* q = out;
+    if (mb->rounds_custom) {
+        q += sprintf(q, "$%c$rounds=%lu$", alg->id, mb->rounds);
+    }
+    else {
+        q += sprintf(q, "$%c$", alg->id);
+    }
+    memcpy(q, mb->salt, mb->salt_len);
+    q += mb->salt_len;
+    *q++ = '$';
+    for (int t = 0; t < alg->triples; t++) {
+        const unsigned char* o = alg->order + 3 * t;
+        q = b64(q, (uint32_t)d[o[0]] << 16 | (uint32_t)d[o[1]] << 8 | d[o[2]], 4);
+    }
+    uint32_t w = 0;
+    for (int i = 0; i < 3; i++) {
+        w = w << 8 | (alg->tail[i] < 0 ? 0 : d[alg->tail[i]]);
+    }
+    q = b64(q, w, alg->tail_chars);
+    *q = '\0';
+}
+
+
+struct MbCrypt* mbCryptCreate(const char* setting) {
+    const struct Algorithm* alg = NULL;
+    for (size_t i = 0; i < sizeof(algorithms) / sizeof(algorithms[0]); i++) {
+        if (setting[0] == '$' && setting[1] == algorithms[i].id && setting[2] == '$') {
+            alg = &algorithms[i];
+        }
+    }
+    if (alg == NULL) {
+        return NULL;
+    }
+    selectKernels();
+    struct MbCrypt* mb = aligned_alloc(64, sizeof(struct MbCrypt));
+    if (mb == NULL) {
+        return NULL;
+    }
+    memset(mb, 0, sizeof(struct MbCrypt));
+    mb->alg = alg;
+    mb->rounds = alg->rounds;
+
+    // "rounds=<n>$" (SHA-crypt only) is clamped to 1000 .. 999999999 the way crypt() does
+    const char* p = setting + 3;
+    if (alg->type != ALG_MD5 && strncmp(p, "rounds=", 7) == 0) {
+        char* endptr;
+        unsigned long n = strtoul(p + 7, &endptr, 10);
+        if (*endptr == '$') {
+            p = endptr + 1;
+            mb->rounds = n < 1000 ? 1000 : n > 999999999 ? 999999999 : n;
+            mb->rounds_custom = 1;
+        }
+    }
+    while (p[mb->salt_len] != '\0' && p[mb->salt_len] != '$' && mb->salt_len < alg->max_salt) {
+        mb->salt[mb->salt_len] = p[mb->salt_len];
+        mb->salt_len++;
+    }
+
+    // The S sequence only depends on the salt and the first byte of A, so it is done up front
+    if (alg->type != ALG_MD5) {
+        unsigned char* repeated = malloc(SALT_REPEAT_MAX * mb->salt_len + 1);
+        if (repeated == NULL) {
+            free(mb);
+            return NULL;
+        }
+        for (int i = 0; i < SALT_REPEAT_MAX; i++) {
+            memcpy(repeated + i * mb->salt_len, mb->salt, mb->salt_len);
+        }
+        const unsigned char* msgs[MB_MAXLANES];
+        size_t lens[MB_MAXLANES];
+        unsigned char digests[MB_MAXLANES][64];
+        for (int first = 0; first < 256; first += alg->lanes) {
+            for (int lane = 0; lane < alg->lanes; lane++) {
+                msgs[lane] = repeated;
+                lens[lane] = (16 + first + lane) * mb->salt_len;
+            }
+            hashLanes(alg, msgs, lens, digests);
+            for (int lane = 0; lane < alg->lanes; lane++) {
+                memcpy(mb->s_seq[first + lane], digests[lane], mb->salt_len);
+            }
+        }
+        free(repeated);
+    }
+    return mb;
+}
+
+int mbCryptLanes(const struct MbCrypt* mb) {
+    return mb->alg->lanes;
+}
+
+void mbCrypt(struct MbCrypt* mb, const char* const* keys, size_t key_len, char hashes[][MB_HASHLEN]) {
+    const struct Algorithm* alg = mb->alg;
+    if (key_len != mb->key_len) {
+        layoutRounds(mb, key_len);
+    }
+    unsigned char a[MB_MAXLANES][64];
+    unsigned char p[MB_MAXLANES][MB_MAXKEY];
+    unsigned char s[MB_MAXLANES][16];
+    setupLanes(mb, keys, key_len, a, p, s);
+    buildRounds(mb, p, s);
+
+    // The rounds start from A, then the last round's digest is the hash
+    union State digest;
+    union Words start;
+    for (int lane = 0; lane < alg->lanes; lane++) {
+        for (int j = 0; j < alg->digest / alg->word; j++) {
+            putWord(alg, &start, j, lane, a[lane] + j * alg->word);
+        }
+    }
+    for (int j = 0; j < alg->digest / alg->word; j++) {
+        if (alg->word == 8) {
+            digest.w64[j] = start.w64[j];
+        }
+        else {
+            digest.w32[j] = start.w32[j];
+        }
+    }
+    if (alg->type == ALG_MD5) {
+        md5_rounds(mb, digest.w32);
+    }
+    else if (alg->type == ALG_SHA256) {
+        sha256_rounds(mb, digest.w32);
+    }
+    else {
+        sha512_rounds(mb, digest.w64);
+    }
+    for (int lane = 0; lane < alg->lanes; lane++) {
+        getDigest(alg, &digest, lane, a[lane]);
+        encodeHash(mb, a[lane], hashes[lane]);
+    }
+}
+
+void mbCryptFree(struct MbCrypt* mb) {
+    free(mb);
+}
+
+const char* mbCryptKernel(void) {
+    selectKernels();
+    return kernel_name;
+}
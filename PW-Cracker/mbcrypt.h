@@ -0,0 +1,35 @@
+//MBCRYPT - Multi-buffer MD5-crypt ($1$), SHA-256-crypt ($5$) and SHA-512-crypt ($6$)
+//
+//Hashes a whole batch of candidate passwords against one setting at a time. Every
+//candidate in the batch goes through the same hash steps, so each instruction works
+//on all of them at once (see mbcrypt.c for how the lanes map onto SSE2/AVX2/AVX-512).
+//
+//    struct MbCrypt* mb = mbCryptCreate("$6$saltsalt");
+//    const char* keys[MB_MAXLANES] = { ... };     // mbCryptLanes(mb) of them, all the same length
+//    char hashes[MB_MAXLANES][MB_HASHLEN];
+//    mbCrypt(mb, keys, key_len, hashes);           // hashes[i] is what crypt(keys[i], setting) gives
+//
+//An MbCrypt holds scratch space for its batch, so each thread needs its own.
+
+#ifndef MBCRYPT_H
+#define MBCRYPT_H
+
+#include <stddef.h>
+
+#define MB_MAXLANES 16      // Most candidates hashed per call
+#define MB_MAXKEY 32        // Longest candidate password
+#define MB_HASHLEN 128      // Room for any hash string produced, with its NUL
+
+struct MbCrypt;
+
+// Returns NULL if the setting is not an MD5-crypt or SHA-crypt one (or can't be allocated)
+struct MbCrypt* mbCryptCreate(const char* setting);
+int mbCryptLanes(const struct MbCrypt* mb);
+// keys[0 .. mbCryptLanes() - 1] must all be key_len (1 to MB_MAXKEY) characters long
+void mbCrypt(struct MbCrypt* mb, const char* const* keys, size_t key_len, char hashes[][MB_HASHLEN]);
+void mbCryptFree(struct MbCrypt* mb);
+
+// Name of the instruction set the kernels run with ("avx512f", "avx2" or "generic")
+const char* mbCryptKernel(void);
+
+#endif
@@ -0,0 +1,1209 @@
+//LIBRLE - Streaming run-length encoder/decoder (see librle.h for the API)
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RLE_X86 1
+#endif
+#include "librle.h"
+
+#define BUFFERSIZE (1 << 16)  // Longest literal record the encoder writes
+
+// Compressed File Format (version 2):
+//   header:  0x00 'R' 'L' 'E' <version byte> <varint K>
+//   records: <varint tag> where the low two bits of the tag give the record kind
+//            and the remaining bits give its length
+//     RLE_RUN:     length = number of repeats, followed by the K-byte pattern
+//     RLE_LITERAL: length = number of bytes, followed by that many raw bytes
+//     RLE_PERIOD:  length = the compression length K used by the records that follow
+//     RLE_END:     length = 0, marks the end of the records
+//   index:   (optional, after RLE_END) <varint entry count> then per entry the varint
+//            deltas of its uncompressed and compressed offsets and its varint K
+//   footer:  (only with an index) 8-byte little-endian offset of the index, then "RIDX"
+// Varints are little-endian base 128. Files from the old format (a count byte
+// followed by a K-byte pattern, repeated) never begin with a zero byte, which
+// is how the decoder tells the two apart.
+#define RLE_MAGIC "\0RLE"
+#define RLE_MAGIC_LEN 4
+#define RLE_VERSION 2
+#define RLE_RUN 0
+#define RLE_LITERAL 1
+#define RLE_PERIOD 2
+#define RLE_END 3
+#define RLE_KIND_BITS 2
+#define VARINT_MAX 10         // Bytes needed for a 64-bit varint
+#define INDEX_MAGIC "RIDX"
+#define FOOTER_LEN 12
+#define INDEX_INTERVAL (1 << 18)    // Uncompressed bytes between seek index entries
+
+// Compression length selection (auto and adaptive modes)
+#define SAMPLESIZE 8192             // Bytes of input analysed per sample
+#define SAMPLES 16                  // Samples spread across the file in auto mode
+#define ADAPTIVE_BLOCK (1 << 16)    // Input bytes between decisions in adaptive mode
+#define ADAPTIVE_REFRESH 8          // Most decisions in a row taken without trying every length
+#define DRIFT_SHIFT 3               // Change in the current length's cost (1/8) that calls for a new look
+#define SWITCH_MARGIN 16            // Estimated bytes a new length must save before switching
+#define PERIODS (sizeof(candidate_periods) / sizeof(candidate_periods[0]))
+#define MAXPERIOD 64
+
+static const size_t candidate_periods[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 24, 32, 48, MAXPERIOD };
+
+// Decoder states
+#define DEC_START 0           // Nothing read yet
+#define DEC_HEADER 1          // Collecting the header into the stash
+#define DEC_TAG 2             // Collecting a record tag into the stash
+#define DEC_PATTERN 3         // Collecting a run's pattern
+#define DEC_RUN 4             // Writing out a run
+#define DEC_LITERAL 5         // Copying a literal through
+#define DEC_LEGACY_COUNT 6    // Old format: waiting for a count byte
+#define DEC_LEGACY_PATTERN 7  // Old format: collecting the pattern after it
+#define DEC_DONE 8            // End of the records (or of the requested range)
+
+
+// Seek index: records start at these uncompressed/compressed offset pairs
+struct IndexEntry {
+    uint64_t raw;
+    uint64_t packed;
+    size_t k;
+};
+
+struct Index {
+    struct IndexEntry* entries;
+    size_t count;
+    size_t cap;
+    uint64_t next;  // Uncompressed offset at which the next entry is due
+};
+
+struct RleEncoder {
+    size_t k;
+    int flags;
+    int error;
+    char started;           // Header written
+    char finished;          // End record (and index) written
+    uint64_t raw;           // Uncompressed bytes decided so far
+    uint64_t produced;      // Compressed bytes produced so far
+    uint64_t next_choice;   // Uncompressed offset of the next adaptive decision
+    uint64_t sample_cost;   // Estimated cost of the current length when every length was last tried
+    int unsampled;          // Decisions taken since then
+    // A run that was still matching at the end of the input seen so far
+    unsigned char* pattern;
+    size_t pattern_cap;
+    uint64_t run;           // Periods matched so far (0 when no run is open)
+    uint64_t run_raw;       // Uncompressed offset the open run started at
+    // Undecided bytes held over from the end of the caller's previous input
+    unsigned char* carry;
+    size_t carry_len;
+    size_t carry_cap;
+    // Output that did not fit in the caller's buffer
+    unsigned char* pending;
+    size_t pending_pos;
+    size_t pending_len;
+    size_t pending_cap;
+    // The caller's output buffer for the current call
+    unsigned char* out;
+    size_t out_len;
+    struct Index index;
+};
+
+struct RleDecoder {
+    int state;
+    size_t k;
+    size_t legacy_k;
+    char legacy;            // Input is in the old format
+    unsigned char stash[RLE_MAGIC_LEN + 1 + VARINT_MAX];  // Header or tag split across inputs
+    size_t stash_len;
+    unsigned char* pattern;
+    size_t pattern_cap;
+    size_t pattern_len;
+    size_t run_pos;         // Bytes of the current period already written
+    uint64_t left;          // Periods left in the run, or bytes left in the literal
+    uint64_t skip;          // Decoded bytes still to be dropped before the requested range
+    uint64_t remaining;     // Decoded bytes still wanted (UINT64_MAX for everything)
+};
+
+
+// Run Detection Kernels:
+// match_len() returns how many leading bytes of a and b agree (at most len).
+// Comparing the stream against itself shifted by K finds where a run of identical
+// K-byte periods breaks in a single call. fill_len() is the K=1 fast path and
+// returns how many leading bytes of buf are equal to c. differ_len() is the
+// inverse of match_len() and lets literal spans skip ahead to the next place
+// a run could start.
+static size_t match_len_scalar(const unsigned char* a, const unsigned char* b, size_t len) {
+    size_t i = 0;
+    while (i < len && a[i] == b[i]) {
+        i++;
+    }
+    return i;
+}
+
+static size_t fill_len_scalar(const unsigned char* buf, size_t len, unsigned char c) {
+    size_t i = 0;
+    while (i < len && buf[i] == c) {
+        i++;
+    }
+    return i;
+}
+
+static size_t differ_len_scalar(const unsigned char* a, const unsigned char* b, size_t len) {
+    size_t i = 0;
+    while (i < len && a[i] != b[i]) {
+        i++;
+    }
+    return i;
+}
+
+#ifdef RLE_X86
+__attribute__((target("sse2")))
+static size_t match_len_sse2(const unsigned char* a, const unsigned char* b, size_t len) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+        unsigned diff = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) ^ 0xFFFFu;
+        if (diff != 0) {
+            return i + __builtin_ctz(diff);
+        }
+    }
+    return i + match_len_scalar(a + i, b + i, len - i);
+}
+
+__attribute__((target("sse2")))
+static size_t fill_len_sse2(const unsigned char* buf, size_t len, unsigned char c) {
+    __m128i vc = _mm_set1_epi8((char)c);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(buf + i));
+        unsigned diff = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, vc)) ^ 0xFFFFu;
+        if (diff != 0) {
+            return i + __builtin_ctz(diff);
+        }
+    }
+    return i + fill_len_scalar(buf + i, len - i, c);
+}
+
+__attribute__((target("sse2")))
+static size_t differ_len_sse2(const unsigned char* a, const unsigned char* b, size_t len) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+        unsigned same = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+        if (same != 0) {
+            return i + __builtin_ctz(same);
+        }
+    }
+    return i + differ_len_scalar(a + i, b + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t match_len_avx2(const unsigned char* a, const unsigned char* b, size_t len) {
+    size_t i = 0;
+    // Two lanes per iteration keeps both load ports busy on long runs
+    for (; i + 64 <= len; i += 64) {
+        __m256i eq0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(a + i)),
+                                        _mm256_loadu_si256((const __m256i*)(b + i)));
+        __m256i eq1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(a + i + 32)),
+                                        _mm256_loadu_si256((const __m256i*)(b + i + 32)));
+        unsigned diff0 = ~(unsigned)_mm256_movemask_epi8(eq0);
+        unsigned diff1 = ~(unsigned)_mm256_movemask_epi8(eq1);
+        if ((diff0 | diff1) != 0) {
+            return diff0 != 0 ? i + __builtin_ctz(diff0) : i + 32 + __builtin_ctz(diff1);
+        }
+    }
+    for (; i + 32 <= len; i += 32) {
+        __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(a + i)),
+                                       _mm256_loadu_si256((const __m256i*)(b + i)));
+        unsigned diff = ~(unsigned)_mm256_movemask_epi8(eq);
+        if (diff != 0) {
+            return i + __builtin_ctz(diff);
+        }
+    }
+    return i + match_len_scalar(a + i, b + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t fill_len_avx2(const unsigned char* buf, size_t len, unsigned char c) {
+    __m256i vc = _mm256_set1_epi8((char)c);
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m256i eq0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(buf + i)), vc);
+        __m256i eq1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(buf + i + 32)), vc);
+        unsigned diff0 = ~(unsigned)_mm256_movemask_epi8(eq0);
+        unsigned diff1 = ~(unsigned)_mm256_movemask_epi8(eq1);
+        if ((diff0 | diff1) != 0) {
+            return diff0 != 0 ? i + __builtin_ctz(diff0) : i + 32 + __builtin_ctz(diff1);
+        }
+    }
+    for (; i + 32 <= len; i += 32) {
+        unsigned diff = ~(unsigned)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(buf + i)), vc));
+        if (diff != 0) {
+            return i + __builtin_ctz(diff);
+        }
+    }
+    return i + fill_len_scalar(buf + i, len - i, c);
+}
+
+__attribute__((target("avx2")))
+static size_t differ_len_avx2(const unsigned char* a, const unsigned char* b, size_t len) {
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(a + i)),
+                                       _mm256_loadu_si256((const __m256i*)(b + i)));
+        unsigned same = (unsigned)_mm256_movemask_epi8(eq);
+        if (same != 0) {
+            return i + __builtin_ctz(same);
+        }
+    }
+    return i + differ_len_scalar(a + i, b + i, len - i);
+}
+#endif
+
+// Kernels in use. selectKernels() runs once as the program (or the library) is loaded,
+// so they are never changed while an encoder or decoder on another thread uses them
+static size_t (*match_len)(const unsigned char*, const unsigned char*, size_t) = match_len_scalar;
+static size_t (*fill_len)(const unsigned char*, size_t, unsigned char) = fill_len_scalar;
+static size_t (*differ_len)(const unsigned char*, const unsigned char*, size_t) = differ_len_scalar;
+
+#ifdef RLE_X86
+__attribute__((constructor)) static void selectKernels(void) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        match_len = match_len_avx2;
+        fill_len = fill_len_avx2;
+        differ_len = differ_len_avx2;
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+        match_len = match_len_sse2;
+        fill_len = fill_len_sse2;
+        differ_len = differ_len_sse2;
+    }
+}
+#endif
+
+
+// Count the identical K-byte periods at the start of buf (at least 1)
+// Caller guarantees that avail >= k
+static size_t countPeriods(const unsigned char* buf, size_t avail, size_t k) {
+    size_t limit = avail / k;
+    if (limit <= 1) {
+        return 1;
+    }
+    size_t same;
+    if (k == 1) {
+        same = fill_len(buf + 1, limit - 1, buf[0]);
+    }
+    else {
+        same = match_len(buf, buf + k, (limit - 1) * k);
+    }
+    return 1 + same / k;
+}
+
+// Decide what starts at buf: returns the number of periods when a run worth its own record
+// begins here, otherwise 0 with *skip set to how many bytes can go straight into a literal
+static size_t findRun(const unsigned char* buf, size_t avail, size_t k, size_t* skip) {
+    size_t periods = avail >= 2 * k ? countPeriods(buf, avail, k) : 1;
+    // Short repeats cost less as part of a literal than as their own record
+    if ((periods - 1) * k > 2) {
+        return periods;
+    }
+    // Nothing can repeat before the next byte that matches the one K ahead of it
+    *skip = 1;
+    if (avail > k + 1) {
+        *skip += differ_len(buf + 1, buf + 1 + k, avail - k - 1);
+    }
+    return 0;
+}
+
+static int varintLen(uint64_t value) {
+    int n = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        n++;
+    }
+    return n;
+}
+
+
+// Compression Length Selection:
+// Each candidate length is run over a sample with the same run/literal decisions the
+// compressor makes, counting the bytes it would write instead of writing them.
+static uint64_t estimateCost(const unsigned char* buf, size_t len, size_t k) {
+    size_t pos = 0;
+    size_t lit = 0;
+    uint64_t cost = 0;
+    while (pos < len) {
+        size_t skip = 0;
+        size_t periods = findRun(buf + pos, len - pos, k, &skip);
+        if (periods == 0) {
+            pos += skip;
+            continue;
+        }
+        if (pos > lit) {
+            cost += varintLen((pos - lit) << RLE_KIND_BITS) + (pos - lit);
+        }
+        cost += varintLen(periods << RLE_KIND_BITS) + k;
+        pos += periods * k;
+        lit = pos;
+    }
+    if (len > lit) {
+        cost += varintLen((len - lit) << RLE_KIND_BITS) + (len - lit);
+    }
+    return cost;
+}
+
+static void estimateCosts(const unsigned char* buf, size_t len, uint64_t* costs) {
+    for (size_t c = 0; c < PERIODS; c++) {
+        costs[c] += estimateCost(buf, len, candidate_periods[c]);
+    }
+}
+
+// Cheapest candidate, though 'current' is kept unless switching saves SWITCH_MARGIN bytes
+static size_t bestPeriod(const uint64_t* costs, size_t current) {
+    size_t best = 0;
+    for (size_t c = 1; c < PERIODS; c++) {
+        if (costs[c] < costs[best]) {
+            best = c;
+        }
+    }
+    for (size_t c = 0; c < PERIODS; c++) {
+        if (candidate_periods[c] == current && costs[c] <= costs[best] + SWITCH_MARGIN) {
+            return current;
+        }
+    }
+    return candidate_periods[best];
+}
+
+static size_t samplePeriod(const unsigned char* buf, size_t len, size_t current) {
+    uint64_t costs[PERIODS] = { 0 };
+    estimateCosts(buf, len < SAMPLESIZE ? len : SAMPLESIZE, costs);
+    return bestPeriod(costs, current);
+}
+
+// Auto mode: spread samples across the whole file with pread(), leaving the read offset alone
+// Returns 0 when the input cannot be sampled this way (the encoder then samples its first window)
+size_t rleAutoPeriod(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        return 0;
+    }
+    unsigned char* sample = malloc(SAMPLESIZE);
+    if (sample == NULL) {
+        return 0;
+    }
+    uint64_t costs[PERIODS] = { 0 };
+    off_t span = st.st_size > SAMPLESIZE ? st.st_size - SAMPLESIZE : 0;
+    int samples = span > (off_t)SAMPLES * SAMPLESIZE ? SAMPLES : 1;
+    for (int i = 0; i < samples; i++) {
+        off_t at = samples > 1 ? span / (samples - 1) * i : 0;
+        ssize_t read_stat = pread(fd, sample, SAMPLESIZE, at);
+        if (read_stat <= 0) {
+            free(sample);
+            return 0;
+        }
+        estimateCosts(sample, read_stat, costs);
+    }
+    free(sample);
+    return bestPeriod(costs, 0);
+}
+
+
+
+
+// Varint from an in-memory buffer; returns 0 if it runs past the end
+static int parseVarint(const unsigned char** p, const unsigned char* end, uint64_t* value) {
+    *value = 0;
+    for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+        unsigned char byte = *(*p)++;
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Make sure a pattern buffer can hold k bytes
+static int reservePattern(unsigned char** pattern, size_t* cap, size_t k) {
+    if (*cap >= k) {
+        return 1;
+    }
+    unsigned char* grown = realloc(*pattern, k);
+    if (grown == NULL) {
+        return 0;
+    }
+    *pattern = grown;
+    *cap = k;
+    return 1;
+}
+
+// Lay a pattern down once, then keep doubling what has been written until len bytes are filled
+static void fillPattern(unsigned char* dst, const unsigned char* pattern, size_t k, size_t len) {
+    if (k == 1) {
+        memset(dst, pattern[0], len);
+        return;
+    }
+    memcpy(dst, pattern, k);
+    size_t done = k;
+    while (done < len) {
+        size_t chunk = done < len - done ? done : len - done;
+        memcpy(dst + done, dst, chunk);
+        done += chunk;
+    }
+}
+
+
+// Encoder Output:
+// Records go straight into the caller's buffer; only what does not fit is held back
+static void emit(struct RleEncoder* enc, const void* src, size_t len) {
+    const unsigned char* bytes = src;
+    enc->produced += len;
+    if (enc->pending_len == 0) {
+        size_t n = len < enc->out_len ? len : enc->out_len;
+        memcpy(enc->out, bytes, n);
+        enc->out += n;
+        enc->out_len -= n;
+        bytes += n;
+        len -= n;
+    }
+    if (len == 0) {
+        return;
+    }
+    if (enc->pending_len + len > enc->pending_cap) {
+        size_t cap = enc->pending_cap ? enc->pending_cap * 2 : BUFFERSIZE;
+        while (cap < enc->pending_len + len) {
+            cap *= 2;
+        }
+        unsigned char* grown = realloc(enc->pending, cap);
+        if (grown == NULL) {
+            enc->error = RLE_ERR_MEMORY;
+            return;
+        }
+        enc->pending = grown;
+        enc->pending_cap = cap;
+    }
+    memcpy(enc->pending + enc->pending_len, bytes, len);
+    enc->pending_len += len;
+}
+
+static void drainPending(struct RleEncoder* enc) {
+    size_t n = enc->pending_len - enc->pending_pos;
+    if (n > enc->out_len) {
+        n = enc->out_len;
+    }
+    if (n == 0) {
+        return;
+    }
+    memcpy(enc->out, enc->pending + enc->pending_pos, n);
+    enc->out += n;
+    enc->out_len -= n;
+    enc->pending_pos += n;
+    if (enc->pending_pos == enc->pending_len) {
+        enc->pending_pos = 0;
+        enc->pending_len = 0;
+    }
+}
+
+static void putVarint(struct RleEncoder* enc, uint64_t value) {
+    unsigned char bytes[VARINT_MAX];
+    int n = 0;
+    while (value >= 0x80) {
+        bytes[n++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    bytes[n++] = (unsigned char)value;
+    emit(enc, bytes, n);
+}
+
+// Note the start of a record in the seek index if an entry is due
+static void indexRecord(struct RleEncoder* enc, uint64_t raw) {
+    struct Index* index = &enc->index;
+    if (!(enc->flags & RLE_INDEX) || raw < index->next) {
+        return;
+    }
+    if (index->count == index->cap) {
+        size_t cap = index->cap ? index->cap * 2 : 64;
+        struct IndexEntry* grown = realloc(index->entries, cap * sizeof(struct IndexEntry));
+        if (grown == NULL) {
+            enc->error = RLE_ERR_MEMORY;
+            return;
+        }
+        index->entries = grown;
+        index->cap = cap;
+    }
+    struct IndexEntry entry = { raw, enc->produced, enc->k };
+    index->entries[index->count++] = entry;
+    index->next = raw + INDEX_INTERVAL;
+}
+
+static void writeLiteral(struct RleEncoder* enc, uint64_t raw, const unsigned char* bytes, size_t len) {
+    if (len == 0) {
+        return;
+    }
+    indexRecord(enc, raw);
+    putVarint(enc, ((uint64_t)len << RLE_KIND_BITS) | RLE_LITERAL);
+    emit(enc, bytes, len);
+}
+
+static void writeRun(struct RleEncoder* enc, uint64_t raw, uint64_t count, const unsigned char* pattern) {
+    indexRecord(enc, raw);
+    putVarint(enc, (count << RLE_KIND_BITS) | RLE_RUN);
+    emit(enc, pattern, enc->k);
+}
+
+// Write RLE_END, then the seek index and its footer if one was asked for
+static void finishStream(struct RleEncoder* enc) {
+    putVarint(enc, RLE_END);
+    if (enc->flags & RLE_INDEX) {
+        uint64_t start = enc->produced;
+        uint64_t raw = 0;
+        uint64_t packed = 0;
+        putVarint(enc, enc->index.count);
+        for (size_t i = 0; i < enc->index.count; i++) {
+            putVarint(enc, enc->index.entries[i].raw - raw);
+            putVarint(enc, enc->index.entries[i].packed - packed);
+            putVarint(enc, enc->index.entries[i].k);
+            raw = enc->index.entries[i].raw;
+            packed = enc->index.entries[i].packed;
+        }
+        unsigned char footer[FOOTER_LEN];
+        for (int i = 0; i < 8; i++) {
+            footer[i] = (unsigned char)(start >> (8 * i));
+        }
+        memcpy(footer + 8, INDEX_MAGIC, 4);
+        emit(enc, footer, FOOTER_LEN);
+    }
+    enc->finished = 1;
+}
+
+// Bytes the encoder must see past a position before deciding what starts there
+static size_t decisionWindow(struct RleEncoder* enc) {
+    size_t need = 2 * enc->k + 4;
+    return need > SAMPLESIZE ? need : SAMPLESIZE;
+}
+
+// Adaptive mode: trying every candidate length costs far more than compressing the
+// block, so the next sample is first tried with the current length alone. Only when
+// that costs noticeably more or less than it did the last time every length was tried
+// (or ADAPTIVE_REFRESH decisions have gone by, in case another length started paying
+// off without the current one getting any worse) are they all tried again.
+static int keepPeriod(struct RleEncoder* enc, const unsigned char* buf, size_t len) {
+    if (enc->unsampled >= ADAPTIVE_REFRESH) {
+        enc->unsampled = 0;
+        return 0;
+    }
+    uint64_t cost = estimateCost(buf, len < SAMPLESIZE ? len : SAMPLESIZE, enc->k);
+    uint64_t drift = cost > enc->sample_cost ? cost - enc->sample_cost : enc->sample_cost - cost;
+    // (with some slack, or a sample that squeezes down to a few bytes would never look settled)
+    if (drift > (enc->sample_cost >> DRIFT_SHIFT) + SAMPLESIZE / 256) {
+        enc->unsampled = 0;
+        return 0;
+    }
+    enc->unsampled++;
+    return 1;
+}
+
+// Make the run/literal decisions over buf and write the records out. Returns how many
+// bytes were decided; the rest have to be seen with more input after them (unless 'final')
+static size_t encodeWindow(struct RleEncoder* enc, const unsigned char* buf, size_t len, int final) {
+    size_t pos = 0;
+    size_t lit = 0;     // Start of the literal span not yet written out
+
+    if (!enc->started) {
+        if (enc->k == 0) {
+            if (len < SAMPLESIZE && !final) {
+                return 0;
+            }
+            enc->k = samplePeriod(buf, len, 0);
+        }
+        if (!reservePattern(&enc->pattern, &enc->pattern_cap, enc->k)) {
+            enc->error = RLE_ERR_MEMORY;
+            return 0;
+        }
+        unsigned char version = RLE_VERSION;
+        emit(enc, RLE_MAGIC, RLE_MAGIC_LEN);
+        emit(enc, &version, 1);
+        putVarint(enc, enc->k);
+        enc->started = 1;
+    }
+
+    // Stop as soon as the caller's output is full, so held-back output stays small
+    while (enc->pending_len == 0 && !enc->error) {
+        size_t k = enc->k;
+        size_t avail = len - pos;
+
+        // An open run carries on for as long as the new input keeps repeating its pattern
+        if (enc->run > 0) {
+            if (avail < k && !final) {
+                break;
+            }
+            size_t more = 0;
+            if (avail >= k && memcmp(buf + pos, enc->pattern, k) == 0) {
+                more = countPeriods(buf + pos, avail, k);
+            }
+            enc->run += more;
+            pos += more * k;
+            lit = pos;
+            if (more == avail / k && !final) {
+                break;
+            }
+            writeRun(enc, enc->run_raw, enc->run, enc->pattern);
+            enc->run = 0;
+            continue;
+        }
+        if (avail == 0) {
+            break;
+        }
+        int choose = (enc->flags & RLE_ADAPTIVE) && enc->raw + pos >= enc->next_choice;
+        if (avail < (choose ? SAMPLESIZE : 2 * k + 4) && !final) {
+            break;
+        }
+        if (choose) {
+            enc->next_choice = enc->raw + pos + ADAPTIVE_BLOCK;
+        }
+        if (choose && !keepPeriod(enc, buf + pos, avail)) {
+            size_t best = samplePeriod(buf + pos, avail, k);
+            enc->sample_cost = estimateCost(buf + pos, avail < SAMPLESIZE ? avail : SAMPLESIZE, best);
+            if (best != k) {
+                if (!reservePattern(&enc->pattern, &enc->pattern_cap, best)) {
+                    enc->error = RLE_ERR_MEMORY;
+                    break;
+                }
+                writeLiteral(enc, enc->raw + lit, buf + lit, pos - lit);
+                lit = pos;
+                putVarint(enc, ((uint64_t)best << RLE_KIND_BITS) | RLE_PERIOD);
+                enc->k = best;
+                continue;
+            }
+        }
+
+        size_t skip = 0;
+        size_t periods = findRun(buf + pos, avail, k, &skip);
+        if (periods == 0) {
+            pos += skip;
+            // Literals are capped so the held-back output never has to grow past one of them
+            if (pos - lit >= BUFFERSIZE) {
+                writeLiteral(enc, enc->raw + lit, buf + lit, pos - lit);
+                lit = pos;
+            }
+            continue;
+        }
+        writeLiteral(enc, enc->raw + lit, buf + lit, pos - lit);
+        if (periods == avail / k && !final) {
+            // The run reaches the end of the input seen so far, so it is kept open
+            memcpy(enc->pattern, buf + pos, k);
+            enc->run = periods;
+            enc->run_raw = enc->raw + pos;
+        }
+        else {
+            writeRun(enc, enc->raw + pos, periods, buf + pos);
+        }
+        pos += periods * k;
+        lit = pos;
+    }
+    writeLiteral(enc, enc->raw + lit, buf + lit, pos - lit);
+    return pos;
+}
+
+
+struct RleEncoder* rleEncoderCreate(size_t k, int flags) {
+    struct RleEncoder* enc = calloc(1, sizeof(struct RleEncoder));
+    if (enc == NULL) {
+        return NULL;
+    }
+    enc->k = k;
+    enc->flags = flags;
+    enc->next_choice = ADAPTIVE_BLOCK;
+    enc->unsampled = ADAPTIVE_REFRESH;
+    return enc;
+}
+
+int rleEncode(struct RleEncoder* enc, const unsigned char** in, size_t* in_len,
+              unsigned char** out, size_t* out_len, int finish) {
+    enc->out = *out;
+    enc->out_len = *out_len;
+    drainPending(enc);
+
+    while (!enc->finished && enc->pending_len == 0 && !enc->error) {
+        if (enc->carry_len > 0) {
+            // Top up the held-over bytes with just enough new input to decide past them
+            size_t take = enc->carry_cap - enc->carry_len;
+            if (take > *in_len) {
+                take = *in_len;
+            }
+            memcpy(enc->carry + enc->carry_len, *in, take);
+            enc->carry_len += take;
+            *in += take;
+            *in_len -= take;
+            size_t used = encodeWindow(enc, enc->carry, enc->carry_len, finish && *in_len == 0);
+            enc->raw += used;
+            size_t rest = enc->carry_len - used;
+            if (rest <= take) {
+                // Everything undecided came from the caller's buffer, so work from it directly again
+                *in -= rest;
+                *in_len += rest;
+                enc->carry_len = 0;
+            }
+            else {
+                memmove(enc->carry, enc->carry + used, rest);
+                enc->carry_len = rest;
+            }
+            if (used == 0 && take == 0) {
+                break;
+            }
+            continue;
+        }
+        if (*in_len == 0 && !finish) {
+            break;
+        }
+        size_t used = encodeWindow(enc, *in, *in_len, finish);
+        enc->raw += used;
+        *in += used;
+        *in_len -= used;
+        if (enc->pending_len > 0 || enc->error) {
+            break;
+        }
+        if (finish) {
+            finishStream(enc);
+            break;
+        }
+        // The undecided tail is held over, since the caller's buffer is gone after this call
+        if (*in_len > 0) {
+            size_t cap = 2 * decisionWindow(enc);
+            if (enc->carry_cap < cap) {
+                unsigned char* grown = realloc(enc->carry, cap);
+                if (grown == NULL) {
+                    enc->error = RLE_ERR_MEMORY;
+                    break;
+                }
+                enc->carry = grown;
+                enc->carry_cap = cap;
+            }
+            memcpy(enc->carry, *in, *in_len);
+            enc->carry_len = *in_len;
+            *in += *in_len;
+            *in_len = 0;
+        }
+        break;
+    }
+    drainPending(enc);
+    *out = enc->out;
+    *out_len = enc->out_len;
+    if (enc->error) {
+        return enc->error;
+    }
+    return enc->finished && enc->pending_len == 0 ? RLE_STREAM_END : RLE_OK;
+}
+
+void rleEncoderFree(struct RleEncoder* enc) {
+    if (enc == NULL) {
+        return;
+    }
+    free(enc->pattern);
+    free(enc->carry);
+    free(enc->pending);
+    free(enc->index.entries);
+    free(enc);
+}
+
+
+// Decoder Output:
+// Pass up to len decoded bytes on to the caller, cutting out the requested range.
+// Returns how many of them were used up
+static size_t emitBytes(struct RleDecoder* dec, const unsigned char* src, size_t len,
+                        unsigned char** out, size_t* out_len) {
+    size_t used = 0;
+    if (dec->skip > 0) {
+        used = dec->skip < len ? dec->skip : len;
+        dec->skip -= used;
+    }
+    size_t n = len - used;
+    if (n > *out_len) {
+        n = *out_len;
+    }
+    if (n > dec->remaining) {
+        n = dec->remaining;
+    }
+    memcpy(*out, src + used, n);
+    *out += n;
+    *out_len -= n;
+    dec->remaining -= n;
+    return used + n;
+}
+
+// Write out what is left of the current run; returns 1 once it is complete
+static int expandRun(struct RleDecoder* dec, unsigned char** out, size_t* out_len) {
+    size_t k = dec->pattern_len;
+    // Whole periods before the requested range are dropped without being expanded
+    if (dec->skip > 0 && dec->run_pos == 0) {
+        uint64_t dropped = dec->skip / k;
+        if (dropped > dec->left) {
+            dropped = dec->left;
+        }
+        dec->left -= dropped;
+        dec->skip -= dropped * k;
+        if (dec->left > 0 && dec->skip > 0) {
+            dec->run_pos = dec->skip;
+            dec->skip = 0;
+        }
+    }
+    while (dec->left > 0 && dec->remaining > 0) {
+        if (*out_len == 0) {
+            return 0;
+        }
+        if (dec->run_pos == 0 && *out_len >= k && dec->remaining >= k) {
+            uint64_t n = *out_len / k;
+            if (n > dec->remaining / k) {
+                n = dec->remaining / k;
+            }
+            if (n > dec->left) {
+                n = dec->left;
+            }
+            fillPattern(*out, dec->pattern, k, n * k);
+            *out += n * k;
+            *out_len -= n * k;
+            dec->remaining -= n * k;
+            dec->left -= n;
+            continue;
+        }
+        size_t n = k - dec->run_pos;
+        if (n > *out_len) {
+            n = *out_len;
+        }
+        if (n > dec->remaining) {
+            n = dec->remaining;
+        }
+        memcpy(*out, dec->pattern + dec->run_pos, n);
+        *out += n;
+        *out_len -= n;
+        dec->remaining -= n;
+        dec->run_pos += n;
+        if (dec->run_pos == k) {
+            dec->run_pos = 0;
+            dec->left--;
+        }
+    }
+    dec->left = 0;
+    dec->run_pos = 0;
+    return 1;
+}
+
+// Collect bytes into the stash until a varint ending at least 'min' bytes in is complete.
+// Returns 1 when complete, 0 when more input is needed and -1 if it is too long to be valid
+static int stashVarint(struct RleDecoder* dec, const unsigned char** in, size_t* in_len, size_t min) {
+    while (*in_len > 0) {
+        if (dec->stash_len == sizeof(dec->stash)) {
+            return -1;
+        }
+        unsigned char byte = *(*in)++;
+        (*in_len)--;
+        dec->stash[dec->stash_len++] = byte;
+        if (dec->stash_len > min && !(byte & 0x80)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Act on a complete record tag
+static int startRecord(struct RleDecoder* dec, uint64_t tag) {
+    uint64_t len = tag >> RLE_KIND_BITS;
+    switch (tag & ((1 << RLE_KIND_BITS) - 1)) {
+        case RLE_RUN:
+            if (len > UINT64_MAX / dec->k) {
+                return RLE_ERR_CORRUPT;
+            }
+            dec->left = len;
+            dec->pattern_len = 0;
+            dec->state = DEC_PATTERN;
+            break;
+        case RLE_LITERAL:
+            dec->left = len;
+            dec->state = DEC_LITERAL;
+            break;
+        case RLE_PERIOD:
+            if (len < 1 || len > SIZE_MAX / 2) {
+                return RLE_ERR_CORRUPT;
+            }
+            if (!reservePattern(&dec->pattern, &dec->pattern_cap, len)) {
+                return RLE_ERR_MEMORY;
+            }
+            dec->k = len;
+            dec->state = DEC_TAG;
+            break;
+        default:
+            if (len != 0) {
+                return RLE_ERR_RECORD;
+            }
+            // Anything after the end record (such as the seek index) is not data
+            dec->state = DEC_DONE;
+    }
+    return RLE_OK;
+}
+
+
+struct RleDecoder* rleDecoderCreate(size_t legacy_k) {
+    struct RleDecoder* dec = calloc(1, sizeof(struct RleDecoder));
+    if (dec == NULL) {
+        return NULL;
+    }
+    dec->state = DEC_START;
+    dec->legacy_k = legacy_k;
+    dec->remaining = UINT64_MAX;
+    return dec;
+}
+
+void rleDecoderSetRange(struct RleDecoder* dec, uint64_t offset, uint64_t length) {
+    dec->skip = offset;
+    dec->remaining = length;
+}
+
+int rleDecoderSeek(struct RleDecoder* dec, uint64_t raw, size_t k) {
+    if (!reservePattern(&dec->pattern, &dec->pattern_cap, k)) {
+        return RLE_ERR_MEMORY;
+    }
+    dec->k = k;
+    dec->state = DEC_TAG;
+    dec->stash_len = 0;
+    dec->skip = raw < dec->skip ? dec->skip - raw : 0;
+    return RLE_OK;
+}
+
+int rleDecode(struct RleDecoder* dec, const unsigned char** in, size_t* in_len,
+              unsigned char** out, size_t* out_len, int finish) {
+    while (1) {
+        if (dec->remaining == 0) {
+            dec->state = DEC_DONE;
+        }
+        int ready;
+        size_t n;
+        switch (dec->state) {
+            case DEC_DONE:
+                *in += *in_len;
+                *in_len = 0;
+                return RLE_STREAM_END;
+
+            case DEC_START:
+                if (*in_len == 0) {
+                    break;
+                }
+                if (**in == 0) {
+                    dec->state = DEC_HEADER;
+                    continue;
+                }
+                if (dec->legacy_k == 0) {
+                    return RLE_ERR_LEGACY;
+                }
+                if (!reservePattern(&dec->pattern, &dec->pattern_cap, dec->legacy_k)) {
+                    return RLE_ERR_MEMORY;
+                }
+                dec->k = dec->legacy_k;
+                dec->legacy = 1;
+                dec->state = DEC_LEGACY_COUNT;
+                continue;
+
+            case DEC_HEADER:
+                ready = stashVarint(dec, in, in_len, RLE_MAGIC_LEN + 1);
+                if (ready == 0) {
+                    break;
+                }
+                if (ready < 0 || memcmp(dec->stash, RLE_MAGIC, RLE_MAGIC_LEN) != 0) {
+                    return RLE_ERR_CORRUPT;
+                }
+                if (dec->stash[RLE_MAGIC_LEN] != RLE_VERSION) {
+                    return RLE_ERR_VERSION;
+                }
+                const unsigned char* p = dec->stash + RLE_MAGIC_LEN + 1;
+                uint64_t k;
+                parseVarint(&p, dec->stash + dec->stash_len, &k);
+                if (k < 1 || k > SIZE_MAX / 2) {
+                    return RLE_ERR_CORRUPT;
+                }
+                if (!reservePattern(&dec->pattern, &dec->pattern_cap, k)) {
+                    return RLE_ERR_MEMORY;
+                }
+                dec->k = k;
+                dec->stash_len = 0;
+                dec->state = DEC_TAG;
+                continue;
+
+            case DEC_TAG:
+                ready = stashVarint(dec, in, in_len, 0);
+                if (ready == 0) {
+                    break;
+                }
+                if (ready < 0) {
+                    return RLE_ERR_CORRUPT;
+                }
+                const unsigned char* t = dec->stash;
+                uint64_t tag;
+                parseVarint(&t, dec->stash + dec->stash_len, &tag);
+                dec->stash_len = 0;
+                ready = startRecord(dec, tag);
+                if (ready != RLE_OK) {
+                    return ready;
+                }
+                continue;
+
+            case DEC_PATTERN:
+            case DEC_LEGACY_PATTERN:
+                n = dec->k - dec->pattern_len;
+                if (n > *in_len) {
+                    n = *in_len;
+                }
+                memcpy(dec->pattern + dec->pattern_len, *in, n);
+                dec->pattern_len += n;
+                *in += n;
+                *in_len -= n;
+                if (dec->pattern_len < dec->k) {
+                    break;
+                }
+                dec->run_pos = 0;
+                dec->state = DEC_RUN;
+                continue;
+
+            case DEC_RUN:
+                if (!expandRun(dec, out, out_len)) {
+                    return RLE_OK;
+                }
+                dec->state = dec->legacy ? DEC_LEGACY_COUNT : DEC_TAG;
+                continue;
+
+            case DEC_LITERAL:
+                if (dec->left == 0) {
+                    dec->state = DEC_TAG;
+                    continue;
+                }
+                if (*in_len == 0) {
+                    break;
+                }
+                n = dec->left < *in_len ? dec->left : *in_len;
+                size_t used = emitBytes(dec, *in, n, out, out_len);
+                *in += used;
+                *in_len -= used;
+                dec->left -= used;
+                if (used < n && dec->remaining > 0) {
+                    return RLE_OK;
+                }
+                continue;
+
+            case DEC_LEGACY_COUNT:
+                if (*in_len == 0) {
+                    break;
+                }
+                dec->left = *(*in)++;
+                (*in_len)--;
+                dec->pattern_len = 0;
+                dec->state = DEC_LEGACY_PATTERN;
+                continue;
+        }
+
+        // Out of input: wait for more, or check the stream ended somewhere it is allowed to
+        if (!finish) {
+            return RLE_OK;
+        }
+        if (dec->state == DEC_LEGACY_PATTERN && dec->pattern_len > 0) {
+            // The final pattern of an old format file may be shorter than K
+            dec->k = dec->pattern_len;
+            dec->run_pos = 0;
+            dec->state = DEC_RUN;
+            continue;
+        }
+        // The current format always finishes with RLE_END, so running out of input
+        // anywhere before it (even between two records) means the file was cut short
+        if (dec->state == DEC_START || dec->state == DEC_LEGACY_COUNT || dec->state == DEC_LEGACY_PATTERN) {
+            dec->state = DEC_DONE;
+            continue;
+        }
+        return RLE_ERR_CORRUPT;
+    }
+}
+
+void rleDecoderFree(struct RleDecoder* dec) {
+    if (dec == NULL) {
+        return;
+    }
+    free(dec->pattern);
+    free(dec);
+}
+
+
+int rleFindSeekPoint(int fd, uint64_t offset, uint64_t* raw, uint64_t* packed, size_t* k) {
+    struct stat st;
+    unsigned char footer[FOOTER_LEN];
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size < FOOTER_LEN + 1) {
+        return 0;
+    }
+    off_t footer_at = st.st_size - FOOTER_LEN;
+    if (pread(fd, footer, FOOTER_LEN, footer_at) != FOOTER_LEN || memcmp(footer + 8, INDEX_MAGIC, 4) != 0) {
+        return 0;
+    }
+    uint64_t start = 0;
+    for (int i = 0; i < 8; i++) {
+        start |= (uint64_t)footer[i] << (8 * i);
+    }
+    // The index always sits right after an RLE_END tag
+    unsigned char tag;
+    if (start < 1 || start >= (uint64_t)footer_at || pread(fd, &tag, 1, start - 1) != 1 || tag != RLE_END) {
+        return 0;
+    }
+    size_t len = footer_at - start;
+    unsigned char* buf = malloc(len);
+    if (buf == NULL || pread(fd, buf, len, start) != (ssize_t)len) {
+        free(buf);
+        return 0;
+    }
+
+    // Entries are in offset order, so the last one at or before 'offset' is the one to use
+    const unsigned char* p = buf;
+    uint64_t count;
+    uint64_t entry_raw = 0;
+    uint64_t entry_packed = 0;
+    int found = 0;
+    if (parseVarint(&p, buf + len, &count)) {
+        for (uint64_t i = 0; i < count; i++) {
+            uint64_t draw, dpacked, entry_k;
+            if (!parseVarint(&p, buf + len, &draw) || !parseVarint(&p, buf + len, &dpacked)
+                || !parseVarint(&p, buf + len, &entry_k) || entry_k < 1 || entry_k > SIZE_MAX / 2) {
+                found = 0;
+                break;
+            }
+            entry_raw += draw;
+            entry_packed += dpacked;
+            if (entry_raw > offset) {
+                break;
+            }
+            *raw = entry_raw;
+            *packed = entry_packed;
+            *k = entry_k;
+            found = 1;
+        }
+    }
+    free(buf);
+    return found;
+}
+
+const char* rleErrorString(int code) {
+    switch (code) {
+        case RLE_OK:
+        case RLE_STREAM_END:
+            return "No Error";
+        case RLE_ERR_CORRUPT:
+            return "Compressed Input is Truncated or Corrupt";
+        case RLE_ERR_VERSION:
+            return "Unsupported Compressed File Version";
+        case RLE_ERR_RECORD:
+            return "Unsupported Record in Compressed File";
+        case RLE_ERR_MEMORY:
+            return "Unable to Allocate Memory";
+        case RLE_ERR_LEGACY:
+            return "Old Format Files Need an Explicit Compression Length";
+    }
+    return "Unknown Error";
+}
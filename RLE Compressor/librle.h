@@ -0,0 +1,67 @@
+//LIBRLE - Streaming run-length encoder/decoder used by the rle command
+//
+//Both directions work on buffers owned by the caller. Each call takes a pointer
+//and length for the input and the output, consumes/produces as much as it can,
+//and advances the pointers and lengths past what it used:
+//
+//    const unsigned char* in = ...;  size_t in_len = ...;
+//    unsigned char* out = ...;       size_t out_len = ...;
+//    int ret = rleEncode(enc, &in, &in_len, &out, &out_len, finish);
+//
+//Call again with more input whenever in_len reaches 0, and with fresh output
+//space whenever out_len reaches 0. Pass finish=1 once the input has ended; the
+//call returns RLE_STREAM_END when everything has been written out. Negative
+//return values are errors (see rleErrorString()).
+//
+//See librle.c for the compressed file format.
+
+#ifndef LIBRLE_H
+#define LIBRLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Return values
+#define RLE_OK 0                // More input or output space needed
+#define RLE_STREAM_END 1        // The stream (or requested range) is complete
+#define RLE_ERR_CORRUPT (-1)    // Compressed input is truncated or corrupt
+#define RLE_ERR_VERSION (-2)    // Compressed input is from an unknown format version
+#define RLE_ERR_RECORD (-3)     // Compressed input holds an unknown record kind
+#define RLE_ERR_MEMORY (-4)     // Allocation failure
+#define RLE_ERR_LEGACY (-5)     // Old format input, but no compression length was given
+
+// Encoder flags
+#define RLE_ADAPTIVE 1          // Pick the compression length again for every block of input
+#define RLE_INDEX 2             // Append a seek index after the records
+
+struct RleEncoder;
+struct RleDecoder;
+
+// A compression length of 0 lets the encoder pick one from the start of the input
+struct RleEncoder* rleEncoderCreate(size_t k, int flags);
+int rleEncode(struct RleEncoder* enc, const unsigned char** in, size_t* in_len,
+              unsigned char** out, size_t* out_len, int finish);
+void rleEncoderFree(struct RleEncoder* enc);
+
+// legacy_k is the compression length for input in the old format (0 if unknown)
+struct RleDecoder* rleDecoderCreate(size_t legacy_k);
+int rleDecode(struct RleDecoder* dec, const unsigned char** in, size_t* in_len,
+              unsigned char** out, size_t* out_len, int finish);
+void rleDecoderFree(struct RleDecoder* dec);
+
+// Only produce bytes [offset, offset + length) of the original data
+void rleDecoderSetRange(struct RleDecoder* dec, uint64_t offset, uint64_t length);
+// The input will carry on from a seek point returned by rleFindSeekPoint()
+// (call after rleDecoderSetRange())
+int rleDecoderSeek(struct RleDecoder* dec, uint64_t raw, size_t k);
+
+// Helpers for regular files (they use pread() and leave the file offset alone):
+// pick a compression length from samples spread across the file (0 if it can't be sampled)
+size_t rleAutoPeriod(int fd);
+// find the last record at or before uncompressed 'offset' in the file's seek index,
+// returns 0 if the file has no index
+int rleFindSeekPoint(int fd, uint64_t offset, uint64_t* raw, uint64_t* packed, size_t* k);
+
+const char* rleErrorString(int code);
+
+#endif
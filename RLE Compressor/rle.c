@@ -1,119 +1,204 @@
+//RLE - Run-length compress or decompress a file (the codec itself lives in librle.c)
+//
+//Build with:
+//gcc -O2 -o rle rle.c librle.c
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include "librle.h"
+
+#define USAGE "rle <input file> <output file> <compression length> <mode> [--index] [--offset <bytes>] [--length <bytes>]\n\
+                \ninput file: the file to compress/decompress (- for standard input)\n\
+                \noutput file: the result of the operation (- for standard output)\n\
+                \ncompression length: the base size of candidate runs (when decompressing, only used for files written in the old format)\n\
+                    auto: sample the input file and pick the length that compresses it best\n\
+                    adaptive: pick the best length again for every block of the input\n\
+                \nmode: specifies whether to compress or decompress- if mode=0, then compress the input file, if mode=1 then decompress the input file\n\
+                \n--index: when compressing, append a seek index so ranges of the file can be decompressed without starting from the beginning\n\
+                \n--offset, --length: when decompressing, only write out this byte range of the original file\n"
+
+#define BUFFERSIZE (1 << 18)  // Size of the input/output blocks handed to read()/write()
+
+
+// Parse a byte count given on the command line
+uint64_t parseBytes(const char* arg, const char* name) {
+    char* endptr;
+    unsigned long long value = strtoull(arg, &endptr, 10);
+    if (endptr == arg || *endptr != '\0' || arg[0] == '-') {
+        fprintf(stderr, "Error: Invalid Byte Count for %s : %s\nProper Use:\n%s", name, arg, USAGE);
+        exit(EXIT_FAILURE);
+    }
+    return value;
+}
+
+void writeAll(int fd, const unsigned char* data, size_t len) {
+    while (len > 0) {
+        ssize_t write_stat = write(fd, data, len);
+        if (write_stat == -1) {
+            perror("Error when Writing to Output File : " );
+            exit(EXIT_FAILURE);
+        }
+        data += write_stat;
+        len -= write_stat;
+    }
+}
+
+// The encoder and decoder calls differ only in the state they take
+int encodeStep(void* state, const unsigned char** in, size_t* in_len, unsigned char** out, size_t* out_len, int finish) {
+    return rleEncode(state, in, in_len, out, out_len, finish);
+}
+
+int decodeStep(void* state, const unsigned char** in, size_t* in_len, unsigned char** out, size_t* out_len, int finish) {
+    return rleDecode(state, in, in_len, out, out_len, finish);
+}
+
+// Feed the input through the encoder/decoder block by block and write out whatever it produces
+void runStream(int file_in, int file_out, void* state,
+               int (*step)(void*, const unsigned char**, size_t*, unsigned char**, size_t*, int)) {
+    unsigned char* in_buf = malloc(BUFFERSIZE);
+    unsigned char* out_buf = malloc(BUFFERSIZE);
+    if (in_buf == NULL || out_buf == NULL) {
+        fprintf(stderr, "Error: Unable to Allocate Buffers\n");
+        exit(EXIT_FAILURE);
+    }
+    int ret = RLE_OK;
+    while (ret == RLE_OK) {
+        ssize_t read_stat = read(file_in, in_buf, BUFFERSIZE);
+        if (read_stat == -1) {
+            perror("Error when Parsing Input File : ");
+            exit(EXIT_FAILURE);
+        }
+        int finish = read_stat == 0;
+        const unsigned char* in = in_buf;
+        size_t in_len = read_stat;
+        // Keep going until this block is used up (and, at the end, until the output is complete)
+        do {
+            unsigned char* out = out_buf;
+            size_t out_len = BUFFERSIZE;
+            ret = step(state, &in, &in_len, &out, &out_len, finish);
+            if (ret < 0) {
+                fprintf(stderr, "Error: %s\n", rleErrorString(ret));
+                exit(EXIT_FAILURE);
+            }
+            writeAll(file_out, out_buf, out - out_buf);
+        } while (ret == RLE_OK && (in_len > 0 || finish));
+    }
+    free(in_buf);
+    free(out_buf);
+}
 
-#define USAGE "rle <input file> <output file> <compression length> <mode>\n\
-                \ninput file: the file to compress/decompress\n\
-                \noutput file: the result of the operation\n\
-                \ncompression length: the base size of candidate runs\n\
-                \nmode: specifies whether to compress or decompress- if mode=0, then compress the input file, if mode=1 then decompress the input file\n"
 
 int main(int argc, char* argv[]) {
 
+    // Separate the optional flags from the four positional arguments
+    char* args[4];
+    int nargs = 0;
+    int flags = 0;
+    char ranged = 0;
+    uint64_t range_offset = 0;
+    uint64_t range_length = UINT64_MAX;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--index") == 0) {
+            flags |= RLE_INDEX;
+        }
+        else if (strcmp(argv[i], "--offset") == 0 && i + 1 < argc) {
+            range_offset = parseBytes(argv[++i], "--offset");
+            ranged = 1;
+        }
+        else if (strcmp(argv[i], "--length") == 0 && i + 1 < argc) {
+            range_length = parseBytes(argv[++i], "--length");
+            ranged = 1;
+        }
+        else if (nargs < 4) {
+            args[nargs++] = argv[i];
+        }
+        else {
+            nargs++;
+        }
+    }
+
     // Error check the passed inputs
-    if (argc != 5) {
-        printf("Error: Improper Command Line Arguments\nProper Use:\n%s", USAGE);
+    if (nargs != 4) {
+        fprintf(stderr, "Error: Improper Command Line Arguments\nProper Use:\n%s", USAGE);
         exit(EXIT_FAILURE);
     }
-    int file_in = open(argv[1], O_RDONLY);
+    int file_in = strcmp(args[0], "-") == 0 ? STDIN_FILENO : open(args[0], O_RDONLY);
     if (file_in == -1) {
         perror("Error Encountered with Input File: " );
         exit(EXIT_FAILURE);
     }
-    int file_out = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-
-    int run_length = atoi(argv[3]);
-    if (run_length < 1) {
-        printf("Error: Zero or Non-Positive Value for Run-Length");
+    int file_out = strcmp(args[1], "-") == 0 ? STDOUT_FILENO : open(args[1], O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (file_out == -1) {
+        perror("Error Encountered with Output File: " );
         exit(EXIT_FAILURE);
     }
-    int mode = atoi(argv[4]);
+
+    int mode = atoi(args[3]);
     if (!(mode == 0 || mode == 1)) {
-        printf("Error: Invalid Selection for Mode");
+        fprintf(stderr, "Error: Invalid Selection for Mode");
+        exit(EXIT_FAILURE);
+    }
+    if ((mode == 0 && ranged) || (mode == 1 && (flags & RLE_INDEX))) {
+        fprintf(stderr, "Error: --index Applies to Compression, --offset/--length to Decompression\n");
+        exit(EXIT_FAILURE);
+    }
+    // A run length of 0 leaves the choice to the encoder (or to the file header)
+    int run_length;
+    if (strcmp(args[2], "auto") == 0) {
+        run_length = mode == 0 ? rleAutoPeriod(file_in) : 0;
+    }
+    else if (strcmp(args[2], "adaptive") == 0) {
+        run_length = 0;
+        flags |= RLE_ADAPTIVE;
+    }
+    else if ((run_length = atoi(args[2])) < 1) {
+        fprintf(stderr, "Error: Zero or Non-Positive Value for Run-Length");
         exit(EXIT_FAILURE);
     }
 
 // Main Logic Variables:
-    char pattern1[run_length];
-    char pattern2[run_length];
-    char pattern1_bytes; 
-    char pattern2_bytes;
-    char equivalent = 1;
-    unsigned char count = 1;
-    int read_stat;
-    int write_stat;
-    int write_stat2;
     int file_stat;
     int file_stat2;
 
-//Compression:
     if(mode == 0) {
-        // Read in first K bytes
-        pattern1_bytes = read(file_in, pattern1, run_length);
-        if (pattern1_bytes == -1) {
-            perror("Error when Parsing Input File : ");
-            exit(EXIT_FAILURE);
-        }
-        // Iterate through following K bytes so long as they are not end of file
-        while((pattern2_bytes = read(file_in, pattern2, run_length)) > 0) {
-            for (int i = 0; i < pattern1_bytes; i++) {
-                if (!(pattern1[i] == pattern2[i])) {
-                    equivalent = 0;
-                    break;
-                }
-            }
-            if (equivalent == 1 && count != 0xFF) {
-                count++;
-            }
-            else {
-                write_stat = write(file_out, &count, 1); // Write the counter to the compression file
-                write_stat2 = write(file_out, pattern1, pattern1_bytes);
-                if ((write_stat == -1) || (write_stat2 == -1)) {
-                    perror("Error when Writing to Output File : " );
-                    exit(EXIT_FAILURE);
-                }
-                // Make sure pattern2 is now the pattern to be compared to 
-                // (Set pattern1 equal to pattern2)
-                for (int i = 0; i < run_length; i++) {
-                    pattern1[i] = pattern2[i];
-                }
-                pattern1_bytes = pattern2_bytes;
-                count = 1;
-                equivalent = 1;
-            }
-        }
-        // Avoid truncating the final pattern (if while condition stops being true it will not be written out)
-        write_stat = write(file_out, &count, 1);
-        write_stat2 = write(file_out, pattern1, pattern1_bytes); // Base it off the previous bytes read in
-        if ((write_stat == -1) || (write_stat2 == -1)) {
-            perror("Error when Writing to Output File : " );
+        struct RleEncoder* enc = rleEncoderCreate(run_length, flags);
+        if (enc == NULL) {
+            fprintf(stderr, "Error: %s\n", rleErrorString(RLE_ERR_MEMORY));
             exit(EXIT_FAILURE);
         }
+        runStream(file_in, file_out, enc, encodeStep);
+        rleEncoderFree(enc);
     }
     else {
-//Decompression:
-        int instances = 0;
-        while((read_stat = read(file_in, &instances, 1)) > 0) { // Read the compression value each iteration through 
-            read_stat = read(file_in, pattern1, run_length); // Obtain the pattern to repeat 
-            if (read_stat == -1) {
-                perror("Error when Parsing Input File : ");
+        struct RleDecoder* dec = rleDecoderCreate(run_length);
+        if (dec == NULL) {
+            fprintf(stderr, "Error: %s\n", rleErrorString(RLE_ERR_MEMORY));
+            exit(EXIT_FAILURE);
+        }
+        rleDecoderSetRange(dec, range_offset, range_length);
+        // A range past the beginning can start from the closest seek index entry before it
+        uint64_t raw;
+        uint64_t packed;
+        size_t k;
+        if (range_offset > 0 && rleFindSeekPoint(file_in, range_offset, &raw, &packed, &k)
+            && lseek(file_in, packed, SEEK_SET) != -1) {
+            int ret = rleDecoderSeek(dec, raw, k);
+            if (ret < 0) {
+                fprintf(stderr, "Error: %s\n", rleErrorString(ret));
                 exit(EXIT_FAILURE);
             }
-
-            for(int i = 0; i < instances; i++) {
-                write_stat = write(file_out, pattern1, read_stat);
-                if (write_stat == -1) {
-                    perror("Error when Writing to Output File : " );
-                    exit(EXIT_FAILURE);
-                }
-            }
         }
+        runStream(file_in, file_out, dec, decodeStep);
+        rleDecoderFree(dec);
     }
 //End:
-    // Close files 
+    // Close files
     file_stat = close(file_in);
     file_stat2 = close(file_out);
     if ((file_stat == -1) || (file_stat2 == -1)) {
@@ -122,4 +207,4 @@ int main(int argc, char* argv[]) {
     }
     return 0;
 
-}
\ No newline at end of file
+}
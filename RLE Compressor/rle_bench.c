@@ -0,0 +1,466 @@
+//RLE_BENCH - Throughput and ratio benchmark for the rle command
+//
+//Usage:
+//rle_bench [rle binary] [corpus megabytes] [work directory]
+//
+//Generates a reproducible corpus (every file comes from a fixed-seed generator) in
+//the work directory, then compresses and decompresses each file with the rle binary
+//at several compression lengths. Every round trip is checked against the original,
+//and copies of each compressed file cut short by 1 to TRUNCATE_MAX bytes must be
+//rejected by the decompressor (the "trunc" column).
+//Each row reports the compression ratio (compressed size / original size), the
+//throughput in MB/s of uncompressed data (best of REPEATS runs), the read()/write()
+//syscalls made and the peak RSS of the rle process. After each corpus, the adaptive
+//row's compression speed is given relative to auto's, which keeps the one length it
+//picked for the whole file, so the gap is what choosing again for every block costs.
+//
+//For example:
+//
+//./rle_bench ./rle 16 /tmp
+//
+//Build with:
+//gcc -O2 -o rle_bench rle_bench.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define USAGE "rle_bench [rle binary] [corpus megabytes] [work directory]"
+#define BUFFERSIZE (1 << 16)
+#define REPEATS 3
+#define TRUNCATE_MAX 4      // Truncated copies of each compressed file checked
+
+// Statistics for one run of the rle binary
+struct RunStats {
+    double seconds;
+    long syscalls;      // read() + write() calls, -1 if /proc/<pid>/io is unavailable
+    long max_rss;       // Kilobytes
+};
+
+struct CorpusFile {
+    const char* name;
+    void (*generate)(unsigned char* buf, size_t len);
+};
+
+static const char* compression_lengths[] = { "1", "2", "3", "4", "8", "auto", "adaptive" };
+
+
+// xorshift64* keeps the corpus identical from run to run and machine to machine
+static uint64_t rng_state;
+
+void seedRandom(uint64_t seed) {
+    rng_state = seed ? seed : 1;
+}
+
+uint64_t nextRandom() {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+
+// Corpus Generators:
+// Long runs of single bytes, with run lengths spread over a few orders of magnitude
+void genRepetitive(unsigned char* buf, size_t len) {
+    seedRandom(1);
+    size_t pos = 0;
+    while (pos < len) {
+        size_t run = 16 + nextRandom() % (nextRandom() % 4 == 0 ? 65536 : 2048);
+        if (run > len - pos) {
+            run = len - pos;
+        }
+        memset(buf + pos, (int)(nextRandom() % 8), run);
+        pos += run;
+    }
+}
+
+void genRandom(unsigned char* buf, size_t len) {
+    seedRandom(2);
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = (unsigned char)(nextRandom() >> 56);
+    }
+}
+
+// Text log lines with timestamps, levels and a handful of recurring messages
+void genLog(unsigned char* buf, size_t len) {
+    static const char* levels[] = { "INFO ", "INFO ", "INFO ", "DEBUG", "WARN ", "ERROR" };
+    static const char* messages[] = {
+        "request completed status=200",
+        "request completed status=404",
+        "cache miss, fetching from backend",
+        "connection pool exhausted, retrying",
+        "worker heartbeat ok",
+        "----------------------------------------",
+    };
+    seedRandom(3);
+    size_t pos = 0;
+    unsigned long seconds = 0;
+    char line[256];
+    while (pos < len) {
+        seconds += nextRandom() % 3;
+        int n = snprintf(line, sizeof(line), "2026-10-19 %02lu:%02lu:%02lu %s [worker-%02d] id=%06lu %s\n",
+                         seconds / 3600 % 24, seconds / 60 % 60, seconds % 60,
+                         levels[nextRandom() % 6], (int)(nextRandom() % 16),
+                         (unsigned long)(nextRandom() % 1000000), messages[nextRandom() % 6]);
+        if ((size_t)n > len - pos) {
+            n = len - pos;
+        }
+        memcpy(buf + pos, line, n);
+        pos += n;
+    }
+}
+
+// Raw RGB and RGBA scanlines: flat colour spans repeat with a period of 3 or 4 bytes,
+// and some scanlines are copies of the one above
+void genImage(unsigned char* buf, size_t len) {
+    seedRandom(4);
+    size_t pos = 0;
+    size_t row_start = 0;
+    size_t row = 0;
+    while (pos < len) {
+        size_t stride = (row / 256) % 2 == 0 ? 3 : 4;
+        size_t width = 1024 * stride;
+        if (row > 0 && nextRandom() % 4 == 0 && pos - row_start == width) {
+            size_t n = width < len - pos ? width : len - pos;
+            memmove(buf + pos, buf + row_start, n);
+            row_start = pos;
+            pos += n;
+            row++;
+            continue;
+        }
+        row_start = pos;
+        size_t end = pos + width < len ? pos + width : len;
+        while (pos < end) {
+            unsigned char pixel[4];
+            for (size_t c = 0; c < stride; c++) {
+                pixel[c] = (unsigned char)(nextRandom() >> 56);
+            }
+            size_t span = 1 + nextRandom() % 200;
+            for (size_t i = 0; i < span && pos < end; i++) {
+                for (size_t c = 0; c < stride && pos < end; c++) {
+                    buf[pos++] = pixel[c];
+                }
+            }
+        }
+        row++;
+    }
+}
+
+static const struct CorpusFile corpus[] = {
+    { "repetitive", genRepetitive },
+    { "random", genRandom },
+    { "log", genLog },
+    { "image", genImage },
+};
+
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Read the syscall counters of a child that has exited but not yet been reaped
+long countSyscalls(pid_t pid) {
+    char path[64];
+    char line[128];
+    long total = 0;
+    int found = 0;
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    FILE* io = fopen(path, "r");
+    if (io == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), io) != NULL) {
+        long value;
+        if (sscanf(line, "syscr: %ld", &value) == 1 || sscanf(line, "syscw: %ld", &value) == 1) {
+            total += value;
+            found++;
+        }
+    }
+    fclose(io);
+    return found == 2 ? total : -1;
+}
+
+// Run the rle binary once; returns 0 if it exited successfully
+// (quiet discards its error messages too, for runs expected to fail)
+int runRle(const char* rle, const char* in, const char* out, const char* length, const char* mode,
+           int quiet, struct RunStats* stats) {
+    double start = now();
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == -1) {
+        perror("Error Forking: ");
+        exit(EXIT_FAILURE);
+    }
+    if (child == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd != -1) {
+            dup2(null_fd, STDOUT_FILENO);
+            if (quiet) {
+                dup2(null_fd, STDERR_FILENO);
+            }
+        }
+        execl(rle, rle, in, out, length, mode, (char*)NULL);
+        perror("Error Launching rle: ");
+        exit(127);
+    }
+
+    // Leave the child as a zombie long enough to read its /proc counters
+    siginfo_t info;
+    if (waitid(P_PID, child, &info, WEXITED | WNOWAIT) == -1) {
+        perror("Error Waiting on rle: ");
+        exit(EXIT_FAILURE);
+    }
+    stats->seconds = now() - start;
+    stats->syscalls = countSyscalls(child);
+
+    int status;
+    struct rusage usage;
+    if (wait4(child, &status, 0, &usage) == -1) {
+        perror("Error Waiting on rle: ");
+        exit(EXIT_FAILURE);
+    }
+    stats->max_rss = usage.ru_maxrss;
+    return !(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+// Best of REPEATS runs for the time, the last run for everything else
+int benchRle(const char* rle, const char* in, const char* out, const char* length, const char* mode, struct RunStats* best) {
+    best->seconds = -1;
+    for (int i = 0; i < REPEATS; i++) {
+        struct RunStats stats;
+        if (runRle(rle, in, out, length, mode, 0, &stats) != 0) {
+            return 1;
+        }
+        double fastest = best->seconds;
+        *best = stats;
+        if (fastest >= 0 && fastest < stats.seconds) {
+            best->seconds = fastest;
+        }
+    }
+    return 0;
+}
+
+off_t fileSize(const char* path) {
+    struct stat st;
+    if (stat(path, &st) == -1) {
+        return -1;
+    }
+    return st.st_size;
+}
+
+// Returns 1 when both files hold the same bytes
+int sameFiles(const char* a, const char* b) {
+    static unsigned char buf_a[BUFFERSIZE];
+    static unsigned char buf_b[BUFFERSIZE];
+    int fd_a = open(a, O_RDONLY);
+    int fd_b = open(b, O_RDONLY);
+    int same = fd_a != -1 && fd_b != -1;
+    while (same) {
+        ssize_t n_a = read(fd_a, buf_a, BUFFERSIZE);
+        ssize_t n_b = 0;
+        // Reads from a regular file only come up short at the end
+        while (n_b < n_a) {
+            ssize_t n = read(fd_b, buf_b + n_b, n_a - n_b);
+            if (n <= 0) {
+                break;
+            }
+            n_b += n;
+        }
+        if (n_a != n_b || n_a < 0 || memcmp(buf_a, buf_b, n_a) != 0) {
+            same = 0;
+        }
+        if (n_a <= 0) {
+            break;
+        }
+    }
+    if (same) {
+        char extra;
+        same = read(fd_b, &extra, 1) == 0;
+    }
+    if (fd_a != -1) {
+        close(fd_a);
+    }
+    if (fd_b != -1) {
+        close(fd_b);
+    }
+    return same;
+}
+
+// Copy a file with its last drop bytes left off; returns 0 on success
+int truncatedCopy(const char* src, const char* dst, off_t drop) {
+    static unsigned char buf[BUFFERSIZE];
+    off_t left = fileSize(src) - drop;
+    int fd_in = open(src, O_RDONLY);
+    int fd_out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    int ret = left < 0 || fd_in == -1 || fd_out == -1 ? -1 : 0;
+    while (ret == 0 && left > 0) {
+        ssize_t n = read(fd_in, buf, left < BUFFERSIZE ? left : BUFFERSIZE);
+        if (n <= 0 || write(fd_out, buf, n) != n) {
+            ret = -1;
+        }
+        left -= n;
+    }
+    if (fd_in != -1) {
+        close(fd_in);
+    }
+    if (fd_out != -1) {
+        close(fd_out);
+    }
+    return ret;
+}
+
+// Returns 1 when the decompressor fails on every copy of packed cut short by 1 to
+// TRUNCATE_MAX bytes (cutting 1 byte always ends the file between two records)
+int rejectsTruncation(const char* rle, const char* packed, const char* cut, const char* out, const char* length) {
+    for (off_t drop = 1; drop <= TRUNCATE_MAX; drop++) {
+        struct RunStats stats;
+        if (truncatedCopy(packed, cut, drop) != 0 || runRle(rle, cut, out, length, "1", 1, &stats) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// The corpus is generated in a child process, so the bench itself stays small and the
+// peak RSS a forked rle process inherits from it does not hide the RSS of rle itself
+void writeCorpusFile(const char* path, const struct CorpusFile* file, size_t len) {
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == -1) {
+        perror("Error Forking: ");
+        exit(EXIT_FAILURE);
+    }
+    if (child == 0) {
+        unsigned char* data = malloc(len);
+        if (data == NULL) {
+            printf("Error: Unable to Allocate %zu Byte Corpus\n", len);
+            exit(EXIT_FAILURE);
+        }
+        file->generate(data, len);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+        if (fd == -1) {
+            perror("Error Creating Corpus File: ");
+            exit(EXIT_FAILURE);
+        }
+        const unsigned char* pos = data;
+        while (len > 0) {
+            ssize_t n = write(fd, pos, len);
+            if (n == -1) {
+                perror("Error Writing Corpus File: ");
+                exit(EXIT_FAILURE);
+            }
+            pos += n;
+            len -= n;
+        }
+        close(fd);
+        exit(EXIT_SUCCESS);
+    }
+    int status;
+    if (waitpid(child, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("Error: Unable to Create Corpus File %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+int main(int argc, char* argv[]) {
+    const char* rle = "./rle";
+    long megabytes = 16;
+    const char* dir = "/tmp";
+
+    if (argc > 4) {
+        printf("Error: Improper Command Line Arguments\nProper Use:\n%s\n", USAGE);
+        exit(EXIT_FAILURE);
+    }
+    if (argc > 1) {
+        rle = argv[1];
+    }
+    if (argc > 2) {
+        char* endptr;
+        megabytes = strtol(argv[2], &endptr, 10);
+        if (endptr == argv[2] || *endptr != '\0' || megabytes <= 0) {
+            printf("Error: Corpus size must be a positive number of megabytes\nProper Use:\n%s\n", USAGE);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (argc > 3) {
+        dir = argv[3];
+    }
+    if (access(rle, X_OK) != 0) {
+        printf("Error: Cannot execute rle binary '%s'\nProper Use:\n%s\n", rle, USAGE);
+        exit(EXIT_FAILURE);
+    }
+
+    size_t len = (size_t)megabytes << 20;
+
+    int failures = 0;
+    char original[4096];
+    char packed[4096];
+    char unpacked[4096];
+    char cut[4096];
+    printf("%-11s %-9s %8s %12s %12s %9s %9s %9s %9s %-8s %s\n", "corpus", "length", "ratio",
+           "comp MB/s", "decomp MB/s", "comp sys", "dec sys", "comp KB", "dec KB", "check", "trunc");
+
+    for (size_t f = 0; f < sizeof(corpus) / sizeof(corpus[0]); f++) {
+        snprintf(original, sizeof(original), "%s/rle_bench_%s.bin", dir, corpus[f].name);
+        snprintf(packed, sizeof(packed), "%s/rle_bench_%s.rle", dir, corpus[f].name);
+        snprintf(unpacked, sizeof(unpacked), "%s/rle_bench_%s.out", dir, corpus[f].name);
+        snprintf(cut, sizeof(cut), "%s/rle_bench_%s.cut", dir, corpus[f].name);
+        writeCorpusFile(original, &corpus[f], len);
+        double fixed_speed = 0;
+        double adaptive_speed = 0;
+
+        for (size_t l = 0; l < sizeof(compression_lengths) / sizeof(compression_lengths[0]); l++) {
+            const char* length = compression_lengths[l];
+            struct RunStats comp;
+            struct RunStats decomp;
+            int failed = benchRle(rle, original, packed, length, "0", &comp)
+                         || benchRle(rle, packed, unpacked, length, "1", &decomp);
+            int verified = !failed && sameFiles(original, unpacked);
+            int rejected = !failed && rejectsTruncation(rle, packed, cut, unpacked, length);
+            if (!verified || !rejected) {
+                failures++;
+            }
+            if (failed) {
+                printf("%-11s %-9s rle exited with an error\n", corpus[f].name, length);
+                continue;
+            }
+            double megs = (double)len / (1 << 20);
+            if (strcmp(length, "auto") == 0) {
+                fixed_speed = megs / comp.seconds;
+            }
+            else if (strcmp(length, "adaptive") == 0) {
+                adaptive_speed = megs / comp.seconds;
+            }
+            printf("%-11s %-9s %8.4f %12.1f %12.1f %9ld %9ld %9ld %9ld %-8s %s\n", corpus[f].name, length,
+                   (double)fileSize(packed) / len, megs / comp.seconds, megs / decomp.seconds,
+                   comp.syscalls, decomp.syscalls, comp.max_rss, decomp.max_rss,
+                   verified ? "ok" : "MISMATCH", rejected ? "ok" : "ACCEPTED");
+        }
+        if (fixed_speed > 0 && adaptive_speed > 0) {
+            printf("%-11s adaptive compresses at %.2fx the speed of auto\n", corpus[f].name,
+                   adaptive_speed / fixed_speed);
+        }
+        unlink(original);
+        unlink(packed);
+        unlink(unpacked);
+        unlink(cut);
+    }
+
+    if (failures > 0) {
+        printf("%d round trip or truncation check(s) failed\n", failures);
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
@@ -10,17 +10,136 @@
 //For example, "grep slush ( sort -r ( ls -l -a" returns a reverse sorted list
 //of all files in the current directory that contain the string "slush" in
 //
+//Any stage may redirect its input from a file with "< file", or its output to a
+//file with "> file" (or ">> file" to append). Quotes ('...' or "...") and
+//backslashes keep spaces and the characters ( < > & inside an argument.
+//
+//A line ending in '&' runs in the background; "wait" waits for background jobs.
+//
+//Starting a line with "time" prints the wall time, CPU time, peak memory and
+//context switches of each of its stages once it finishes.
+//
+//Usage:
+//slush [-j jobs] [-l stats log] [script]
+//
+//With a script, its lines are run instead of reading from the terminal. With -j,
+//up to that many lines run at once: lines are taken to be independent of each
+//other unless separated by "wait" (cd and hash also wait for the -j lines before them).
+//With -l, the same statistics are appended to the log for every command run, one
+//tab separated line per stage:
+//<unix time> <job> <stage> <command> <real s> <user s> <sys s> <max RSS kB>
+//<voluntary context switches> <involuntary context switches> <status> <command line>
+//
+//"cat" (without options) and "tee" run inside the shell as well, moving data
+//between pipes and files with splice() and tee() rather than copying it through
+//a separate process.
+//
+//Build with:
+//gcc -O2 -pthread -o slush slush.c
+//
 //See the lab writeup for more details and other requirements.
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <pthread.h>
 #include <unistd.h>  
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <time.h>
+
+extern char** environ;
 
 #define BUFFERSIZE 1024
-#define TOKENS 15
+#define ARENABLOCK (1 << 16)
+#define PUMPCHUNK (1 << 20)   // Most bytes asked of a single splice()/tee()
+#define PUMPBUFFER (1 << 16)  // Buffer for copies splice() can't do
+#define PUMPPOLL 100000000L   // Nanoseconds between checks for Ctrl-C while waiting on pumps
+#define HASHBUCKETS 64
+#define DEFAULTPATH "/bin:/usr/bin"   // Searched when PATH is unset, as execvp() does
+#define MAXJOBS 64
+#define USAGE "slush [-j jobs] [-l stats log] [script]"
+
+
+// Command hash table: remembers where in PATH each command name was found
+struct HashEntry {
+    char* name;
+    char* path;
+    int hits;
+    struct HashEntry* next;
+};
+
+struct HashEntry* hash_table[HASHBUCKETS];
+char* hashed_path = NULL;     // The PATH the table was filled from
+
+// A pipeline stage run for a job, with what wait4() reported once it was reaped.
+// Builtin stages (pid 0) are measured inside the shell while they run
+struct Process {
+    pid_t pid;
+    int stage;
+    int reaped;
+    char* name;
+    struct timespec start;
+    double wall;          // Seconds from launch until it was reaped
+    struct rusage usage;
+    int status;           // As returned by wait4()
+};
+
+// Job table: every command line with processes still running (foreground or not)
+struct Job {
+    int id;               // Job number shown to the user, 0 for a free slot
+    struct Process* procs;
+    int nprocs;
+    int running;          // Processes not yet reaped
+    int background;
+    int parallel;         // Run alongside other lines because of -j (rather than '&')
+    int timed;            // Print the stages' statistics when the job finishes
+    char* command;        // The command line, for messages
+};
+
+// Per-line arena: everything parsed from a command line is carved out of it, and
+// it is emptied (keeping its memory for the next line) once the line has been run
+struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+struct Arena {
+    struct ArenaBlock* first;
+    struct ArenaBlock* current;
+};
+
+// A command line: pipeline stages in the order data flows through them
+struct Stage {
+    char** argv;          // NULL terminated
+    int argc;
+    char* in_file;        // '<' redirection, or NULL
+    char* out_file;       // '>' or '>>' redirection, or NULL
+    int append;           // out_file was given with '>>'
+};
+
+struct Pipeline {
+    struct Stage* stages;
+    int nstages;          // 0 for a blank line
+    int background;       // The line ended in '&'
+};
+
+struct Arena line_arena;
+struct Job jobs[MAXJOBS];
+volatile sig_atomic_t child_exited = 0;   // Set by SIGCHLD, cleared once children are reaped
+int interactive = 1;                      // Reading from the terminal rather than a script
+FILE* stats_log = NULL;                   // Per-stage statistics for every job (-l)
+volatile sig_atomic_t pumps_interrupted = 0;  // SIGINT arrived while cat/tee pumps were running
 
 
 
@@ -31,162 +150,1422 @@ void ignoreSignal(int signum) {
 }
 
 
-// Function to aid in command parsing, will simply remove spaces 
-void rmvspace(char* command, char** out) {
-    int i = 0;
-    char* arg = strtok(command, " ");
-    out[i] = arg; 
-    while(arg != NULL) {             
-        arg = strtok(NULL, " "); 
+// SIGINT while pumps run: they give up on the copy they are in the middle of
+void interruptPumps(int signum) {
+    pumps_interrupted = 1;
+}
+
+
+// Note a child has finished; it is reaped before the next line is run
+void childExited(int signum) {
+    child_exited = 1;
+}
+
+
+void* arenaAlloc(struct Arena* arena, size_t size) {
+    size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+
+    // Blocks past the current one are left over from earlier lines and free to reuse
+    struct ArenaBlock* block = arena->current;
+    while (block != NULL && block->used + size > block->size) {
+        block = block->next;
+        if (block != NULL) {
+            block->used = 0;
+        }
+    }
+    if (block == NULL) {
+        size_t block_size = size > ARENABLOCK ? size : ARENABLOCK;
+        block = malloc(sizeof(struct ArenaBlock) + block_size);
+        if (block == NULL) {
+            printf("Error: Out of Memory\n");
+            exit(-1);
+        }
+        block->next = NULL;
+        block->size = block_size;
+        block->used = 0;
+        if (arena->first == NULL) {
+            arena->first = block;
+        }
+        else {
+            struct ArenaBlock* last = arena->current;
+            while (last->next != NULL) {
+                last = last->next;
+            }
+            last->next = block;
+        }
+    }
+    arena->current = block;
+    void* ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+void arenaReset(struct Arena* arena) {
+    arena->current = arena->first;
+    if (arena->first != NULL) {
+        arena->first->used = 0;
+    }
+}
+
+// Grow an arena array of count elements (the old copy is simply left behind)
+void* arenaGrow(struct Arena* arena, void* array, size_t count, size_t* cap, size_t elem) {
+    if (count < *cap) {
+        return array;
+    }
+    *cap = *cap == 0 ? 8 : *cap * 2;
+    void* grown = arenaAlloc(arena, *cap * elem);
+    if (count > 0) {
+        memcpy(grown, array, count * elem);
+    }
+    return grown;
+}
+
+
+// Copy one word of the command line into text, removing its quotes and backslashes.
+// Advances *line past the word and *text past its terminating NUL. Returns the
+// word, or NULL if a quote was left open
+char* parseWord(const char** line, char** text) {
+    const char* p = *line;
+    char* word = *text;
+    char* out = word;
+    while (*p != '\0' && strchr(" \t\r\n(<>&", *p) == NULL) {
+        if (*p == '\'') {
+            const char* close = strchr(p + 1, '\'');
+            if (close == NULL) {
+                return NULL;
+            }
+            memcpy(out, p + 1, close - p - 1);
+            out += close - p - 1;
+            p = close + 1;
+        }
+        else if (*p == '"') {
+            for (p++; *p != '"'; p++) {
+                if (*p == '\0') {
+                    return NULL;
+                }
+                // Inside double quotes a backslash only escapes \ " $ and `
+                if (*p == '\\' && p[1] != '\0' && strchr("\\\"$`", p[1]) != NULL) {
+                    p++;
+                }
+                *out++ = *p;
+            }
+            p++;
+        }
+        else if (*p == '\\' && p[1] != '\0') {
+            *out++ = p[1];
+            p += 2;
+        }
+        else {
+            *out++ = *p++;
+        }
+    }
+    *out++ = '\0';
+    *line = p;
+    *text = out;
+    return word;
+}
+
+// Parse a whole command line into the arena before anything is run. Returns NULL
+// (after saying why) for a malformed line
+struct Pipeline* parseLine(struct Arena* arena, const char* line) {
+    struct Pipeline* pipeline = arenaAlloc(arena, sizeof(struct Pipeline));
+    size_t stage_cap = 0;
+    size_t argv_cap = 0;
+    struct Stage* stage = NULL;
+
+    // Unquoted words never take more room than the line itself (plus a final NUL)
+    char* text = arenaAlloc(arena, strlen(line) + 1);
+    pipeline->stages = NULL;
+    pipeline->nstages = 0;
+    pipeline->background = 0;
+
+    const char* p = line;
+    while (1) {
+        p += strspn(p, " \t\r\n");
+        if (*p == '&') {
+            p++;
+            p += strspn(p, " \t\r\n");
+            if (*p != '\0') {
+                printf("Error: '&' Can Only End a Command Line\n");
+                return NULL;
+            }
+            pipeline->background = 1;
+        }
+        // A '(' or the end of the line closes off the current stage, which must have a command
+        if (*p == '\0' || *p == '(') {
+            if (stage == NULL ? *p == '(' || pipeline->nstages > 0 : stage->argc == 0) {
+                printf("Error: Missing Command in Pipeline\n");
+                return NULL;
+            }
+            if (*p == '\0') {
+                return pipeline;
+            }
+            stage = NULL;
+            p++;
+            continue;
+        }
+
+        // Start a new stage at the first word after a '(' (or the start of the line)
+        if (stage == NULL) {
+            pipeline->stages = arenaGrow(arena, pipeline->stages, pipeline->nstages, &stage_cap, sizeof(struct Stage));
+            stage = &pipeline->stages[pipeline->nstages++];
+            memset(stage, 0, sizeof(struct Stage));
+            argv_cap = 0;
+            stage->argv = arenaGrow(arena, NULL, 0, &argv_cap, sizeof(char*));
+            stage->argv[0] = NULL;
+        }
+
+        if (*p == '<' || *p == '>') {
+            char kind = *p++;
+            int append = kind == '>' && *p == '>';
+            p += append;
+            p += strspn(p, " \t\r\n");
+            char* file = *p == '\0' || strchr("(<>&", *p) != NULL ? NULL : parseWord(&p, &text);
+            if (file == NULL) {
+                printf("Error: Missing File Name after '%s'\n", kind == '<' ? "<" : append ? ">>" : ">");
+                return NULL;
+            }
+            if (kind == '<') {
+                stage->in_file = file;
+            }
+            else {
+                stage->out_file = file;
+                stage->append = append;
+            }
+            continue;
+        }
+
+        char* word = parseWord(&p, &text);
+        if (word == NULL) {
+            printf("Error: Unterminated Quote\n");
+            return NULL;
+        }
+        stage->argv = arenaGrow(arena, stage->argv, stage->argc + 1, &argv_cap, sizeof(char*));
+        stage->argv[stage->argc++] = word;
+        stage->argv[stage->argc] = NULL;
+    }
+}
+
+
+unsigned int hashName(const char* name) {
+    unsigned int h = 5381;
+    while (*name != '\0') {
+        h = h * 33 + (unsigned char)*name++;
+    }
+    return h % HASHBUCKETS;
+}
+
+// Forget every remembered command
+void clearHash() {
+    for (int i = 0; i < HASHBUCKETS; i++) {
+        while (hash_table[i] != NULL) {
+            struct HashEntry* entry = hash_table[i];
+            hash_table[i] = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+        }
+    }
+}
+
+void forgetCommand(const char* name) {
+    struct HashEntry** link = &hash_table[hashName(name)];
+    while (*link != NULL) {
+        struct HashEntry* entry = *link;
+        if (strcmp(entry->name, name) == 0) {
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            return;
+        }
+        link = &entry->next;
+    }
+}
+
+// Search each PATH directory for an executable file called name
+char* searchPath(const char* name, const char* path) {
+    size_t name_len = strlen(name);
+    const char* dir = path;
+    while (1) {
+        size_t dir_len = strcspn(dir, ":");
+        char* candidate = malloc(dir_len + name_len + 3);
+        if (candidate == NULL) {
+            return NULL;
+        }
+        // An empty PATH element means the current directory
+        if (dir_len == 0) {
+            strcpy(candidate, ".");
+            dir_len = 1;
+        }
+        else {
+            memcpy(candidate, dir, dir_len);
+        }
+        candidate[dir_len] = '/';
+        strcpy(candidate + dir_len + 1, name);
+
+        struct stat st;
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0) {
+            return candidate;
+        }
+        free(candidate);
+        dir += strcspn(dir, ":");
+        if (*dir == '\0') {
+            return NULL;
+        }
+        dir++;
+    }
+}
+
+// Resolve a command name to the program it runs. Names containing a '/' are used
+// as they are; anything else is looked up in the hash table first, then in PATH.
+// Returns NULL if the command can't be found
+const char* findCommand(const char* name) {
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
+
+    // A different PATH makes every remembered location suspect
+    const char* path = getenv("PATH");
+    if (path == NULL) {
+        path = DEFAULTPATH;
+    }
+    if (hashed_path == NULL || strcmp(hashed_path, path) != 0) {
+        clearHash();
+        free(hashed_path);
+        hashed_path = strdup(path);
+    }
+
+    unsigned int bucket = hashName(name);
+    for (struct HashEntry* entry = hash_table[bucket]; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->name, name) == 0) {
+            entry->hits++;
+            return entry->path;
+        }
+    }
+
+    char* found = searchPath(name, path);
+    if (found == NULL) {
+        return NULL;
+    }
+    struct HashEntry* entry = malloc(sizeof(struct HashEntry));
+    if (entry == NULL || (entry->name = strdup(name)) == NULL) {
+        free(entry);
+        free(found);
+        return NULL;
+    }
+    entry->path = found;
+    entry->hits = 1;
+    entry->next = hash_table[bucket];
+    hash_table[bucket] = entry;
+    return found;
+}
+
+// Built in command 'hash': list the remembered commands, "hash -r" forgets them all,
+// and "hash name ..." looks the names up now
+int builtinHash(char** args, FILE* out) {
+    int status = 0;
+    if (args[1] == NULL) {
+        int empty = 1;
+        for (int i = 0; i < HASHBUCKETS; i++) {
+            for (struct HashEntry* entry = hash_table[i]; entry != NULL; entry = entry->next) {
+                if (empty) {
+                    fprintf(out, "hits\tcommand\n");
+                    empty = 0;
+                }
+                fprintf(out, "%4d\t%s\n", entry->hits, entry->path);
+            }
+        }
+        if (empty) {
+            fprintf(out, "hash: hash table empty\n");
+        }
+        return 0;
+    }
+    for (int i = 1; args[i] != NULL; i++) {
+        if (strcmp(args[i], "-r") == 0) {
+            clearHash();
+        }
+        else if (strchr(args[i], '/') != NULL) {
+            continue;
+        }
+        else {
+            // Look the name up afresh; the new entry goes to the head of its bucket,
+            // and looking a name up is not a use of it
+            forgetCommand(args[i]);
+            if (findCommand(args[i]) == NULL) {
+                fprintf(stderr, "hash: %s: not found\n", args[i]);
+                status = 1;
+            }
+            else {
+                hash_table[hashName(args[i])]->hits = 0;
+            }
+        }
+    }
+    return status;
+}
+
+
+// Track a stage of a job; returns its entry, or NULL if it could not be tracked
+struct Process* addProcess(struct Job* job, pid_t pid, int stage, const char* name) {
+    struct Process* procs = realloc(job->procs, (job->nprocs + 1) * sizeof(struct Process));
+    if (procs == NULL) {
+        printf("Error: Unable to Track Process %d\n", (int)pid);
+        return NULL;
+    }
+    job->procs = procs;
+    struct Process* proc = &job->procs[job->nprocs++];
+    memset(proc, 0, sizeof(struct Process));
+    proc->pid = pid;
+    proc->stage = stage;
+    proc->name = strdup(name);
+    clock_gettime(CLOCK_MONOTONIC, &proc->start);
+    job->running++;
+    return proc;
+}
+
+double secondsSince(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+double seconds(const struct timeval* tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+void freeJob(struct Job* job) {
+    for (int i = 0; i < job->nprocs; i++) {
+        free(job->procs[i].name);
+    }
+    free(job->procs);
+    free(job->command);
+    job->procs = NULL;
+    job->nprocs = 0;
+    job->command = NULL;
+    job->id = 0;
+}
+
+int byStage(const void* a, const void* b) {
+    return ((const struct Process*)a)->stage - ((const struct Process*)b)->stage;
+}
+
+// Print a finished job's statistics (for "time") and log them (for -l), then free it
+void finishJob(struct Job* job) {
+    if (job->nprocs > 1) {
+        qsort(job->procs, job->nprocs, sizeof(struct Process), byStage);
+    }
+    time_t now = time(NULL);
+    double real = 0;
+    double user = 0;
+    double sys = 0;
+    if (job->timed) {
+        fprintf(stderr, "%-5s %-16s %10s %10s %10s %10s %8s %8s %7s\n", "stage", "command",
+                "real", "user", "sys", "max RSS", "vol cs", "inv cs", "status");
+    }
+    for (int i = 0; i < job->nprocs; i++) {
+        struct Process* proc = &job->procs[i];
+        char status[16];
+        if (WIFSIGNALED(proc->status)) {
+            snprintf(status, sizeof(status), "sig %d", WTERMSIG(proc->status));
+        }
+        else {
+            snprintf(status, sizeof(status), "%d", WEXITSTATUS(proc->status));
+        }
+        real = proc->wall > real ? proc->wall : real;
+        user += seconds(&proc->usage.ru_utime);
+        sys += seconds(&proc->usage.ru_stime);
+        if (job->timed) {
+            fprintf(stderr, "%-5d %-16.16s %9.3fs %9.3fs %9.3fs %8ldkB %8ld %8ld %7s\n", proc->stage, proc->name,
+                    proc->wall, seconds(&proc->usage.ru_utime), seconds(&proc->usage.ru_stime),
+                    proc->usage.ru_maxrss, proc->usage.ru_nvcsw, proc->usage.ru_nivcsw, status);
+        }
+        if (stats_log != NULL) {
+            fprintf(stats_log, "%ld\t%d\t%d\t%s\t%.6f\t%.6f\t%.6f\t%ld\t%ld\t%ld\t%s\t%s\n", (long)now, job->id,
+                    proc->stage, proc->name, proc->wall, seconds(&proc->usage.ru_utime),
+                    seconds(&proc->usage.ru_stime), proc->usage.ru_maxrss, proc->usage.ru_nvcsw,
+                    proc->usage.ru_nivcsw, status, job->command);
+        }
+    }
+    if (job->timed) {
+        fprintf(stderr, "%-5s %-16s %9.3fs %9.3fs %9.3fs\n", "total", "", real, user, sys);
+    }
+    if (stats_log != NULL) {
+        fflush(stats_log);
+    }
+    freeJob(job);
+}
+
+// Reap one child (waitpid() options, so WNOHANG to only take one that has already
+// finished) and record its status and resource usage in its job. Returns its pid,
+// 0 if none was ready, or -1 when there are no children left.
+// Wall times run until the child is reaped: exact while the shell is waiting on it,
+// but a background job that finishes between lines is only reaped at the next line.
+// Linux carries the peak RSS of the launching process across exec, so max RSS is
+// never below the shell's own
+pid_t reapChild(int options) {
+    int status;
+    struct rusage usage;
+    pid_t pid = wait4(-1, &status, options, &usage);
+    if (pid == -1 && errno == ECHILD) {
+        // Nothing left to wait on, so no job can still be running
+        for (int i = 0; i < MAXJOBS; i++) {
+            jobs[i].running = 0;
+        }
+        return -1;
+    }
+    if (pid <= 0) {
+        return 0;
+    }
+    for (int i = 0; i < MAXJOBS; i++) {
+        for (int j = 0; jobs[i].id != 0 && j < jobs[i].nprocs; j++) {
+            struct Process* proc = &jobs[i].procs[j];
+            if (proc->pid == pid && !proc->reaped) {
+                proc->reaped = 1;
+                proc->wall = secondsSince(&proc->start);
+                proc->usage = usage;
+                proc->status = status;
+                jobs[i].running--;
+            }
+        }
+    }
+    return pid;
+}
+
+// Reap whatever has finished since the last SIGCHLD, and let go of finished
+// background and -j jobs (telling the user about the background ones at the terminal)
+void reportJobs() {
+    if (child_exited) {
+        child_exited = 0;
+        while (reapChild(WNOHANG) > 0) { }
+    }
+    for (int i = 0; i < MAXJOBS; i++) {
+        if (jobs[i].id != 0 && (jobs[i].background || jobs[i].parallel) && jobs[i].running == 0) {
+            if (jobs[i].background && interactive) {
+                printf("[%d] Done\t%s\n", jobs[i].id, jobs[i].command);
+            }
+            finishJob(&jobs[i]);
+        }
+    }
+}
+
+void waitJob(struct Job* job) {
+    while (job->running > 0 && reapChild(0) != -1) { }
+}
+
+void waitAllJobs() {
+    while (reapChild(0) != -1) { }
+}
+
+// Wait for the lines -j is running alongside each other, leaving '&' jobs alone
+void waitParallelJobs() {
+    for (int i = 0; i < MAXJOBS; i++) {
+        if (jobs[i].id != 0 && jobs[i].parallel) {
+            waitJob(&jobs[i]);
+        }
+    }
+}
+
+int runningJobs() {
+    int count = 0;
+    for (int i = 0; i < MAXJOBS; i++) {
+        if (jobs[i].id != 0 && jobs[i].running > 0) {
+            count++;
+        }
+    }
+    return count;
+}
+
+
+// Take a free job table slot for a command line. If the table is full, wait
+// until a background or -j job finishes
+struct Job* newJob(const char* line, int background) {
+    int id = 1;
+    struct Job* job = NULL;
+    while (job == NULL) {
+        for (int i = 0; i < MAXJOBS; i++) {
+            if (jobs[i].id == 0) {
+                job = job == NULL ? &jobs[i] : job;
+            }
+            else if (jobs[i].id >= id) {
+                id = jobs[i].id + 1;
+            }
+        }
+        if (job == NULL && reapChild(0) == -1) {
+            return NULL;
+        }
+        if (job == NULL) {
+            reportJobs();
+        }
+    }
+    job->id = id;
+    job->procs = NULL;
+    job->nprocs = 0;
+    job->running = 0;
+    job->background = background;
+    job->parallel = 0;
+    job->timed = 0;
+    job->command = strdup(line);
+    return job;
+}
+
+// Built in command 'wait': wait for every background job, or for the jobs given as
+// %<job number> or process id
+int builtinWait(char** args, FILE* out) {
+    if (args[1] == NULL) {
+        waitAllJobs();
+        return 0;
+    }
+    int status = 0;
+    for (int i = 1; args[i] != NULL; i++) {
+        char* endptr;
+        int is_job = args[i][0] == '%';
+        long id = strtol(args[i] + is_job, &endptr, 10);
+        struct Job* job = NULL;
+        for (int j = 0; endptr != args[i] + is_job && *endptr == '\0' && j < MAXJOBS; j++) {
+            if (jobs[j].id != 0 && is_job && jobs[j].id == id) {
+                job = &jobs[j];
+            }
+            for (int k = 0; jobs[j].id != 0 && !is_job && k < jobs[j].nprocs; k++) {
+                if (jobs[j].procs[k].pid == id && id > 0) {
+                    job = &jobs[j];
+                }
+            }
+        }
+        if (job == NULL) {
+            fprintf(stderr, "wait: %s: no such job\n", args[i]);
+            status = 127;
+            continue;
+        }
+        waitJob(job);
+    }
+    return status;
+}
+
+// Built in command 'jobs': list the background jobs
+int builtinJobs(char** args, FILE* out) {
+    for (int i = 0; i < MAXJOBS; i++) {
+        if (jobs[i].id != 0 && jobs[i].background) {
+            fprintf(out, "[%d] %s\t%s\n", jobs[i].id, jobs[i].running > 0 ? "Running" : "Done", jobs[i].command);
+        }
+    }
+    return 0;
+}
+
+
+// Built in commands run inside the shell itself, writing to out (standard output,
+// or the write end of a pipe when they are a pipeline stage). None of them read
+// standard input (except cat and tee, see below). Each returns an exit status
+int builtinCd(char** args, FILE* out) {
+    if(chdir(args[1]) != 0) {
+        perror("Failed to Change Directory : ");
+        return 1;
+    }
+    return 0;
+}
+
+int builtinEcho(char** args, FILE* out) {
+    int i = 1;
+    int newline = 1;
+    if (args[1] != NULL && strcmp(args[1], "-n") == 0) {
+        newline = 0;
         i++;
-        if (i == sizeof(out) - 1) {
-            printf("Error: Command Arguments Exceed Size of Array\n");
+    }
+    for (int first = i; args[i] != NULL; i++) {
+        fprintf(out, i == first ? "%s" : " %s", args[i]);
+    }
+    if (newline) {
+        fputc('\n', out);
+    }
+    return 0;
+}
+
+int builtinPwd(char** args, FILE* out) {
+    char cwd[BUFFERSIZE];
+    if (getcwd(cwd, BUFFERSIZE) == NULL) {
+        perror("pwd: ");
+        return 1;
+    }
+    fprintf(out, "%s\n", cwd);
+    return 0;
+}
+
+int builtinTrue(char** args, FILE* out) {
+    return 0;
+}
+
+int builtinFalse(char** args, FILE* out) {
+    return 1;
+}
+
+// Write out the character a backslash escape in a printf format stands for, and
+// return the number of format characters it used
+int printEscape(const char* esc, FILE* out) {
+    switch (esc[0]) {
+        case 'n': fputc('\n', out); return 1;
+        case 't': fputc('\t', out); return 1;
+        case 'r': fputc('\r', out); return 1;
+        case 'a': fputc('\a', out); return 1;
+        case 'b': fputc('\b', out); return 1;
+        case 'f': fputc('\f', out); return 1;
+        case 'v': fputc('\v', out); return 1;
+        case '\\': fputc('\\', out); return 1;
+        case '\0': fputc('\\', out); return 0;
+    }
+    if (esc[0] >= '0' && esc[0] <= '7') {
+        int value = 0;
+        int n = 0;
+        while (n < 3 && esc[n] >= '0' && esc[n] <= '7') {
+            value = value * 8 + esc[n++] - '0';
+        }
+        fputc(value, out);
+        return n;
+    }
+    fputc('\\', out);
+    fputc(esc[0], out);
+    return 1;
+}
+
+// printf FORMAT [ARGUMENTS]: the format is reused until the arguments run out
+int builtinPrintf(char** args, FILE* out) {
+    if (args[1] == NULL) {
+        fprintf(stderr, "printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+    const char* format = args[1];
+    char** arg = args + 2;
+    int status = 0;
+    do {
+        char** start = arg;
+        for (const char* f = format; *f != '\0'; f++) {
+            if (*f == '\\') {
+                f += printEscape(f + 1, out);
+                continue;
+            }
+            if (*f != '%') {
+                fputc(*f, out);
+                continue;
+            }
+            if (f[1] == '%') {
+                fputc('%', out);
+                f++;
+                continue;
+            }
+
+            // Copy the conversion (flags, width, precision) to hand to fprintf
+            char spec[32];
+            size_t len = strspn(f + 1, "-+ #0123456789.") + 1;
+            if (len + 3 > sizeof(spec) || f[len] == '\0' || strchr("scdiouxX", f[len]) == NULL) {
+                fprintf(stderr, "printf: invalid conversion in format: %s\n", format);
+                return 1;
+            }
+            memcpy(spec, f, len);
+            char conversion = f[len];
+            f += len;
+            const char* value = *arg != NULL ? *arg++ : NULL;
+
+            if (conversion == 's' || conversion == 'c') {
+                // %c is the first character of its argument (nothing at all if there is none)
+                char first[2] = { value != NULL ? value[0] : '\0', '\0' };
+                spec[len] = 's';
+                spec[len + 1] = '\0';
+                fprintf(out, spec, conversion == 'c' ? first : value != NULL ? value : "");
+            }
+            else {
+                char* endptr = NULL;
+                long long number = value != NULL ? strtoll(value, &endptr, 0) : 0;
+                if (value != NULL && (endptr == value || *endptr != '\0')) {
+                    fprintf(stderr, "printf: %s: invalid number\n", value);
+                    status = 1;
+                }
+                spec[len] = 'l';
+                spec[len + 1] = 'l';
+                spec[len + 2] = conversion;
+                spec[len + 3] = '\0';
+                fprintf(out, spec, number);
+            }
+        }
+        // A format without conversions would loop forever
+        if (arg == start) {
             break;
         }
-        out[i] = arg;
+    } while (*arg != NULL);
+    return status;
+}
+
+int isBinaryOperator(const char* op) {
+    static const char* const ops[] = { "=", "!=", "-eq", "-ne", "-lt", "-le", "-gt", "-ge" };
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (strcmp(op, ops[i]) == 0) {
+            return 1;
+        }
     }
-    out[i+1] = NULL;
+    return 0;
 }
 
+// Evaluate a test expression of up to four words (as POSIX specifies for test).
+// Three words with a binary operator in the middle are always that comparison,
+// even when the first word is "!"
+int testExpression(char** args, int n) {
+    if (n == 0) {
+        return 1;
+    }
+    if (strcmp(args[0], "!") == 0 && n > 1 && !(n == 3 && isBinaryOperator(args[1]))) {
+        int result = testExpression(args + 1, n - 1);
+        return result == 2 ? 2 : !result;
+    }
+    if (n == 1) {
+        return args[0][0] == '\0';
+    }
+    if (n == 2) {
+        struct stat st;
+        const char* op = args[0];
+        const char* arg = args[1];
+        if (strcmp(op, "-n") == 0) return arg[0] == '\0';
+        if (strcmp(op, "-z") == 0) return arg[0] != '\0';
+        if (strcmp(op, "-e") == 0) return stat(arg, &st) != 0;
+        if (strcmp(op, "-f") == 0) return !(stat(arg, &st) == 0 && S_ISREG(st.st_mode));
+        if (strcmp(op, "-d") == 0) return !(stat(arg, &st) == 0 && S_ISDIR(st.st_mode));
+        if (strcmp(op, "-s") == 0) return !(stat(arg, &st) == 0 && st.st_size > 0);
+        if (strcmp(op, "-r") == 0) return access(arg, R_OK) != 0;
+        if (strcmp(op, "-w") == 0) return access(arg, W_OK) != 0;
+        if (strcmp(op, "-x") == 0) return access(arg, X_OK) != 0;
+        fprintf(stderr, "test: %s: unary operator expected\n", op);
+        return 2;
+    }
+    if (n == 3) {
+        const char* op = args[1];
+        if (strcmp(op, "=") == 0) return strcmp(args[0], args[2]) != 0;
+        if (strcmp(op, "!=") == 0) return strcmp(args[0], args[2]) == 0;
 
-void executeCommand(char** command) {
-    // Create a child process to handle the execution
-    pid_t child = fork();
-    if(child == -1) {
-        perror("Error: ");
-        exit(-1);
+        char* end1;
+        char* end2;
+        long long a = strtoll(args[0], &end1, 10);
+        long long b = strtoll(args[2], &end2, 10);
+        int numeric = end1 != args[0] && *end1 == '\0' && end2 != args[2] && *end2 == '\0';
+        if (op[0] == '-' && !numeric) {
+            fprintf(stderr, "test: integer expression expected\n");
+            return 2;
+        }
+        if (strcmp(op, "-eq") == 0) return !(a == b);
+        if (strcmp(op, "-ne") == 0) return !(a != b);
+        if (strcmp(op, "-lt") == 0) return !(a < b);
+        if (strcmp(op, "-le") == 0) return !(a <= b);
+        if (strcmp(op, "-gt") == 0) return !(a > b);
+        if (strcmp(op, "-ge") == 0) return !(a >= b);
+        fprintf(stderr, "test: %s: binary operator expected\n", op);
+        return 2;
     }
+    fprintf(stderr, "test: too many arguments\n");
+    return 2;
+}
 
-    // Child process code
-    if (child == 0) {
-        int ret = execvp(command[0], command);
-        if (ret != 0) {
-            perror("Error: ");
-            exit(-1);
+int builtinTest(char** args, FILE* out) {
+    int n = 0;
+    while (args[n + 1] != NULL) {
+        n++;
+    }
+    // The '[' spelling needs a closing ']', which is not part of the expression
+    if (strcmp(args[0], "[") == 0) {
+        if (n == 0 || strcmp(args[n], "]") != 0) {
+            fprintf(stderr, "[: missing ']'\n");
+            return 2;
         }
+        n--;
     }
-    // Make parent wait on child 
-    else {
-        waitpid(child, NULL, 0);
-        return;
+    return testExpression(args + 1, n);
+}
+
+// The builtins that do read their input, cat and tee, each run on a thread of their
+// own (a pump) while the rest of the pipeline runs, moving data between raw file
+// descriptors. Where one end is a pipe, splice() moves it without it ever passing
+// through user space; anything splice() refuses (a terminal, a file opened for
+// appending) is copied through a buffer instead.
+// SIGINT is caught without SA_RESTART while pumps run, so a blocked splice(), tee(),
+// read() or write() returns EINTR: with pumps_interrupted set, the pump then stops
+// (returning -1 with errno EINTR) instead of trying again. The copy loops also check
+// it on every pass, since a copy that never blocks never sees EINTR.
+
+// Whether Ctrl-C has stopped the pumps (errno is then EINTR for the caller)
+int pumpStopped() {
+    if (pumps_interrupted) {
+        errno = EINTR;
+        return 1;
     }
+    return 0;
 }
 
+int writeAll(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        if (pumpStopped()) {
+            return -1;
+        }
+        ssize_t n = write(fd, data, len);
+        if (n == -1 && errno == EINTR && !pumps_interrupted) {
+            continue;
+        }
+        if (n == -1) {
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
 
-// This function is a single pipe, 2 process exeuction 
-void executePipe(char** args, char** piped) {
-    // Initialize the pipe 
-    // 0 is read stream, 1 is write stream
-    int pipefd[2];
-    if (pipe(pipefd) == -1) {
-        perror("Error: ");
-        exit(-1);
+// Copy src to dst until the end of src
+int pumpData(int src, int dst) {
+    ssize_t n;
+    while ((n = splice(src, NULL, dst, NULL, PUMPCHUNK, SPLICE_F_MOVE)) != 0) {
+        if (pumpStopped()) {
+            return -1;
+        }
+        if (n == -1 && errno == EINVAL) {
+            break;
+        }
+        if (n == -1 && (errno != EINTR || pumps_interrupted)) {
+            return -1;
+        }
     }
-    pid_t child1 = fork();
-    if (child1 == -1) {
-        perror("Error: ");
-        exit(-1);
+    if (n == 0) {
+        return 0;
     }
 
+    char buffer[PUMPBUFFER];
+    while ((n = read(src, buffer, PUMPBUFFER)) != 0) {
+        if (pumpStopped()) {
+            return -1;
+        }
+        if (n == -1 && errno == EINTR && !pumps_interrupted) {
+            continue;
+        }
+        if (n == -1 || writeAll(dst, buffer, n) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Move exactly len bytes out of the pipe src into dst
+int drainPipe(int src, int dst, size_t len) {
+    char buffer[PUMPBUFFER];
+    while (len > 0) {
+        if (pumpStopped()) {
+            return -1;
+        }
+        ssize_t n = splice(src, NULL, dst, NULL, len, SPLICE_F_MOVE);
+        if (n == -1 && errno == EINVAL) {
+            n = read(src, buffer, len < PUMPBUFFER ? len : PUMPBUFFER);
+            if (n > 0 && writeAll(dst, buffer, n) == -1) {
+                return -1;
+            }
+        }
+        if (n == -1 && errno == EINTR && !pumps_interrupted) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
 
-    // Child process for writing to pipe
-    if (child1 == 0) {
-        close(pipefd[0]);
-        dup2(pipefd[1], STDOUT_FILENO);
-        close(pipefd[1]);
+// Copy in to every one of the nsinks descriptors until the end of in. For an input
+// pipe, tee() duplicates what it holds into an empty scratch pipe (sized to match, so
+// it always takes all of it), which is drained into each sink but the last; the
+// last sink then takes the data out of the input pipe itself
+int teeData(int in, int* sinks, int nsinks) {
+    if (nsinks == 1) {
+        return pumpData(in, sinks[0]);
+    }
+    int scratch[2] = { -1, -1 };
+    int size = fcntl(in, F_GETPIPE_SZ);
+    int piped = size != -1 && pipe(scratch) == 0 && fcntl(scratch[1], F_SETPIPE_SZ, size) >= size;
+    int ret = 0;
 
-        int ret = execvp(args[0],args);
-        if (ret != 0) {
-            perror("Error: ");
-            exit(-1);
+    while (piped) {
+        if (pumpStopped()) {
+            ret = -1;
+            break;
+        }
+        ssize_t n = tee(in, scratch[1], PUMPCHUNK, 0);
+        if (n == -1 && errno == EINTR && !pumps_interrupted) {
+            continue;
+        }
+        if (n <= 0) {
+            ret = n;
+            break;
+        }
+        for (int i = 0; i < nsinks - 1 && ret == 0; i++) {
+            if (i > 0 && tee(in, scratch[1], n, 0) != n) {
+                ret = -1;
+            }
+            else {
+                ret = drainPipe(scratch[0], sinks[i], n);
+            }
+        }
+        if (ret == -1 || drainPipe(in, sinks[nsinks - 1], n) == -1) {
+            ret = -1;
+            break;
         }
-        exit(0);
     }
-    else {
-        // Child process for reading from pipe 
-        pid_t child2 = fork();
-        if(child2 == -1) {
-            perror("Error: ");
-            exit(-1);
+    if (scratch[0] != -1) {
+        close(scratch[0]);
+        close(scratch[1]);
+    }
+    if (piped) {
+        return ret;
+    }
+
+    // The input is not a pipe, so it goes through a buffer
+    char buffer[PUMPBUFFER];
+    ssize_t n;
+    while ((n = read(in, buffer, PUMPBUFFER)) != 0) {
+        if (pumpStopped()) {
+            return -1;
+        }
+        if (n == -1 && errno == EINTR && !pumps_interrupted) {
+            continue;
+        }
+        if (n == -1) {
+            return -1;
+        }
+        for (int i = 0; i < nsinks; i++) {
+            if (writeAll(sinks[i], buffer, n) == -1) {
+                return -1;
+            }
         }
+    }
+    return 0;
+}
 
-        if(child2 == 0) {
-            close(pipefd[1]);
-            dup2(pipefd[0], STDIN_FILENO);
-            close(pipefd[0]);
-            int ret = execvp(piped[0], piped);
-            if (ret != 0) {
-                perror("Error: ");
-                exit(-1);
+// cat [file ...]: a file of "-" (or no files at all) is the stage's input
+int pumpCat(char** args, int in_fd, int out_fd) {
+    int status = 0;
+    if (args[1] == NULL) {
+        if (pumpData(in_fd, out_fd) == -1) {
+            if (errno != EPIPE && errno != EINTR) {
+                perror("cat: ");
             }
-            exit(0);
+            status = 1;
         }
-        // Parent must close its ends of the pipe, and wait on last child processes
-        else {
-            close(pipefd[0]);
-            close(pipefd[1]);
-            waitpid(child2, NULL, 0);
+        return status;
+    }
+    for (int i = 1; args[i] != NULL; i++) {
+        int fd = strcmp(args[i], "-") == 0 ? in_fd : open(args[i], O_RDONLY);
+        if (fd == -1) {
+            fprintf(stderr, "cat: %s: %s\n", args[i], strerror(errno));
+            status = 1;
+            continue;
+        }
+        int ret = pumpData(fd, out_fd);
+        int error = errno;
+        if (fd != in_fd) {
+            close(fd);
+        }
+        if (ret == -1) {
+            // Nobody is reading any more (or Ctrl-C), so the remaining files don't matter
+            if (error == EPIPE || error == EINTR) {
+                return 1;
+            }
+            fprintf(stderr, "cat: %s: %s\n", args[i], strerror(error));
+            status = 1;
         }
     }
+    return status;
+}
 
+// tee [-a] [file ...]: the input goes to each file as well as to the output
+int pumpTee(char** args, int in_fd, int out_fd) {
+    int append = args[1] != NULL && strcmp(args[1], "-a") == 0;
+    int nfiles = 0;
+    while (args[1 + append + nfiles] != NULL) {
+        nfiles++;
+    }
+    int* sinks = malloc((nfiles + 1) * sizeof(int));
+    if (sinks == NULL) {
+        fprintf(stderr, "tee: Out of Memory\n");
+        return 1;
+    }
+
+    int status = 0;
+    int nsinks = 0;
+    for (int i = 0; i < nfiles; i++) {
+        char* file = args[1 + append + i];
+        int fd = open(file, O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0666);
+        if (fd == -1) {
+            fprintf(stderr, "tee: %s: %s\n", file, strerror(errno));
+            status = 1;
+            continue;
+        }
+        sinks[nsinks++] = fd;
+    }
+    // The output goes last, so what it is handed is moved rather than copied
+    sinks[nsinks++] = out_fd;
+
+    if (teeData(in_fd, sinks, nsinks) == -1) {
+        if (errno != EPIPE && errno != EINTR) {
+            perror("tee: ");
+        }
+        status = 1;
+    }
+    for (int i = 0; i < nsinks - 1; i++) {
+        close(sinks[i]);
+    }
+    free(sinks);
+    return status;
 }
 
+struct Builtin {
+    const char* name;
+    int (*run)(char** args, FILE* out);
+    int (*pump)(char** args, int in_fd, int out_fd);    // Instead of run, for cat and tee
+};
 
-void execnpipes(char** args, int n) {
-    int ret;
+static const struct Builtin builtins[] = {
+    { "cd", builtinCd, NULL },
+    { "hash", builtinHash, NULL },
+    { "echo", builtinEcho, NULL },
+    { "pwd", builtinPwd, NULL },
+    { "true", builtinTrue, NULL },
+    { "false", builtinFalse, NULL },
+    { "printf", builtinPrintf, NULL },
+    { "test", builtinTest, NULL },
+    { "[", builtinTest, NULL },
+    { "wait", builtinWait, NULL },
+    { "jobs", builtinJobs, NULL },
+    { "cat", NULL, pumpCat },
+    { "tee", NULL, pumpTee },
+};
 
-    // Initialize pipes (read and write) for n - 1 processes 
-    // n - 1 represents the number of pipes needed, *2 represents the read/write ends of each pipe
-    int pipefd[2 * (n-1)];
+const struct Builtin* findBuiltin(const char* name) {
+    if (name == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (strcmp(builtins[i].name, name) == 0) {
+            return &builtins[i];
+        }
+    }
+    return NULL;
+}
+
+// The builtin a pipeline stage runs, if any. cat and tee are left to the real
+// programs when given options other than tee's -a, and in lines that run in the
+// background or alongside others with -j, since the shell waits for its pumps
+// before reading the next line
+const struct Builtin* stageBuiltin(char** argv, int background) {
+    const struct Builtin* builtin = findBuiltin(argv[0]);
+    if (builtin == NULL || builtin->pump == NULL) {
+        return builtin;
+    }
+    if (background) {
+        return NULL;
+    }
+    for (int i = 1; argv[i] != NULL; i++) {
+        int tee_append = i == 1 && builtin->pump == pumpTee && strcmp(argv[i], "-a") == 0;
+        if (argv[i][0] == '-' && argv[i][1] != '\0' && !tee_append) {
+            return NULL;
+        }
+    }
+    return builtin;
+}
+
+// A pump builtin's thread, and what it reports back once joined
+struct Pump {
+    pthread_t thread;
+    const struct Builtin* builtin;
+    char** args;
+    int in_fd;
+    int out_fd;
+    int status;
+    double wall;
+    struct rusage usage;
+};
+
+void* runPump(void* arg) {
+    struct Pump* pump = arg;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pump->status = pump->builtin->pump(pump->args, pump->in_fd, pump->out_fd);
+
+    // Close its ends as soon as it is done, so the stages around it see the end of the data
+    if (pump->in_fd != STDIN_FILENO) {
+        close(pump->in_fd);
+    }
+    if (pump->out_fd != STDOUT_FILENO) {
+        close(pump->out_fd);
+    }
+    pump->wall = secondsSince(&start);
+    getrusage(RUSAGE_THREAD, &pump->usage);
+    return NULL;
+}
+
+
+// Launch a program without waiting on it. The child's standard input/output are
+// replaced by in_fd/out_fd (-1 leaves them alone), and the nclose descriptors in
+// close_fds are closed in the child before the program starts.
+// posix_spawn() avoids copying the shell's page tables the way fork() does.
+// Returns the child's pid, or -1 if the program could not be started
+pid_t spawnCommand(char** command, int in_fd, int out_fd, int* close_fds, int nclose) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t defaults;
+    pid_t child;
+
+    if (command[0] == NULL) {
+        return -1;
+    }
+    // The shell ignores SIGPIPE for its builtins; programs get the usual behaviour back
+    posix_spawnattr_init(&attr);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+    posix_spawn_file_actions_init(&actions);
+    if (in_fd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    }
+    if (out_fd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    }
+    for (int i = 0; i < nclose; i++) {
+        posix_spawn_file_actions_addclose(&actions, close_fds[i]);
+    }
+
+    // Run the program straight from its hashed location (looking again if it has moved)
+    int ret = ENOENT;
+    const char* path = findCommand(command[0]);
+    if (path != NULL) {
+        ret = posix_spawn(&child, path, &actions, &attr, command, environ);
+        if (ret == ENOENT && path != command[0]) {
+            forgetCommand(command[0]);
+            path = findCommand(command[0]);
+            ret = path == NULL ? ENOENT : posix_spawn(&child, path, &actions, &attr, command, environ);
+        }
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (ret != 0) {
+        errno = ret;
+        perror("Error: ");
+        return -1;
+    }
+    return child;
+}
+
+
+// Run a parsed command line, adding its processes to job (the caller decides whether
+// to wait on them)
+void executePipeline(struct Pipeline* line, struct Job* job) {
+    int n = line->nstages;
+
+    // Every descriptor the parent opens for the line: the read/write ends of the n - 1
+    // pipes, then any redirection files. Stages refer to them by index, -1 for none
+    int* fds = arenaAlloc(&line_arena, (2 * (n - 1) + 2 * n) * sizeof(int));
+    int nfds = 0;
+    int* in_idx = arenaAlloc(&line_arena, n * sizeof(int));
+    int* out_idx = arenaAlloc(&line_arena, n * sizeof(int));
     for(int i = 0; i < n - 1; i++) {
-        ret = pipe(pipefd  + i * 2);
-        if (ret == -1) {
+        if (pipe(fds + i * 2) == -1) {
             perror("Error Creating Pipes:  ");
             exit(-1);
         }
+        nfds += 2;
     }
-
-    // Each command present will get its respective fork through this loop
+    // The read end of the previous pipe is opened for middle/end processes, and the
+    // write end of the next pipe for start/middle processes
     for(int i = 0; i < n; i++) {
-        pid_t child = fork();
-        if(child == -1) {
-            perror("Error Forking: ");
-            exit(-1);
-        }
-        if(child == 0) {
-            // This  allows the read end of the pipe to be opened (for middle/end processes)
-            if(i > 0) {
-                dup2(pipefd[(i - 1) * 2], STDIN_FILENO);
+        in_idx[i] = i > 0 ? (i - 1) * 2 : -1;
+        out_idx[i] = i < n - 1 ? i * 2 + 1 : -1;
+    }
+
+    // Redirections replace the pipe ends; if any file can't be opened nothing is run
+    int failed = 0;
+    for(int i = 0; i < n && !failed; i++) {
+        struct Stage* stage = &line->stages[i];
+        if (stage->in_file != NULL) {
+            fds[nfds] = open(stage->in_file, O_RDONLY);
+            if (fds[nfds] == -1) {
+                fprintf(stderr, "%s: ", stage->in_file);
+                perror("Error Opening Input File ");
+                failed = 1;
+                break;
             }
-            // This allows the write end of the pipe to be opened (for start/middle processes)
-            if(i < n -1) {
-                dup2(pipefd[i * 2 + 1], STDOUT_FILENO);
+            in_idx[i] = nfds++;
+        }
+        if (stage->out_file != NULL) {
+            fds[nfds] = open(stage->out_file, O_WRONLY | O_CREAT | (stage->append ? O_APPEND : O_TRUNC), 0666);
+            if (fds[nfds] == -1) {
+                fprintf(stderr, "%s: ", stage->out_file);
+                perror("Error Opening Output File ");
+                failed = 1;
+                break;
             }
+            out_idx[i] = nfds++;
+        }
+    }
 
-            // Close each associated pipe for the child process
-            for(int j = 0; j < 2 * (n-1); j++) {
-                close(pipefd[j]);
+    // Each external command present will get its own process through this loop (every
+    // descriptor is closed in the child once its own are in place). They are all
+    // started before any builtin stage runs, so the builtins have readers
+    const struct Builtin** stage_builtins = arenaAlloc(&line_arena, n * sizeof(struct Builtin*));
+    char* keep = arenaAlloc(&line_arena, nfds + 1);
+    memset(keep, 0, nfds + 1);
+    for(int i = 0; i < n && !failed; i++) {
+        stage_builtins[i] = stageBuiltin(line->stages[i].argv, job->background || job->parallel);
+        if (stage_builtins[i] != NULL) {
+            if (out_idx[i] != -1) {
+                keep[out_idx[i]] = 1;
+            }
+            if (in_idx[i] != -1 && stage_builtins[i]->pump != NULL) {
+                keep[in_idx[i]] = 1;
             }
+            continue;
+        }
+        int in_fd = in_idx[i] != -1 ? fds[in_idx[i]] : -1;
+        int out_fd = out_idx[i] != -1 ? fds[out_idx[i]] : -1;
+        pid_t child = spawnCommand(line->stages[i].argv, in_fd, out_fd, fds, nfds);
+        if (child != -1) {
+            addProcess(job, child, i, line->stages[i].argv[0]);
+        }
+    }
 
-            // Parse current command and execute 
-            char* parsed_args[10];
-            rmvspace(args[i], parsed_args);
-            ret = execvp(parsed_args[0], parsed_args);
-            if(ret == -1) {
-                perror("Error: ");
-                exit(-1);
+    // Parent process will close every descriptor it does not need: it only keeps the
+    // outputs of builtins and the inputs of pumps. Other builtins don't read, so
+    // whatever writes to one sees a closed pipe rather than blocking
+    for(int i = 0; i < nfds; i++) {
+        if (!keep[i]) {
+            close(fds[i]);
+        }
+    }
+    if (failed) {
+        return;
+    }
+
+    // Pumps start next, so they are already moving data when the other builtins write
+    struct Pump* pumps = arenaAlloc(&line_arena, n * sizeof(struct Pump));
+    fflush(stdout);
+
+    // Ctrl-C has to be able to stop the pumps, so while they run SIGINT interrupts
+    // whatever they are blocked in rather than restarting it
+    int npumps = 0;
+    for(int i = 0; i < n; i++) {
+        if (stage_builtins[i] != NULL && stage_builtins[i]->pump != NULL) {
+            npumps++;
+        }
+    }
+    struct sigaction interrupt;
+    struct sigaction previous;
+    if (npumps > 0) {
+        memset(&interrupt, 0, sizeof(interrupt));
+        interrupt.sa_handler = interruptPumps;
+        sigemptyset(&interrupt.sa_mask);
+        pumps_interrupted = 0;
+        sigaction(SIGINT, &interrupt, &previous);
+    }
+    for(int i = 0; i < n; i++) {
+        if (stage_builtins[i] == NULL || stage_builtins[i]->pump == NULL) {
+            continue;
+        }
+        pumps[i].builtin = stage_builtins[i];
+        pumps[i].args = line->stages[i].argv;
+        pumps[i].in_fd = in_idx[i] != -1 ? fds[in_idx[i]] : STDIN_FILENO;
+        pumps[i].out_fd = out_idx[i] != -1 ? fds[out_idx[i]] : STDOUT_FILENO;
+        if (pthread_create(&pumps[i].thread, NULL, runPump, &pumps[i]) != 0) {
+            printf("Error: Unable to Start %s\n", pumps[i].args[0]);
+            pumps[i].builtin = NULL;
+            if (pumps[i].in_fd != STDIN_FILENO) {
+                close(pumps[i].in_fd);
+            }
+            if (pumps[i].out_fd != STDOUT_FILENO) {
+                close(pumps[i].out_fd);
             }
-            exit(0);
         }
     }
-    // Parent process will close all ends of each pipe (it does not need any of them)
-    for(int i = 0; i < 2 * (n -1); i++) {
-        close(pipefd[i]);
+
+    // Builtin stages write straight into their pipe or file (or to standard output)
+    for(int i = 0; i < n; i++) {
+        if (stage_builtins[i] == NULL || stage_builtins[i]->pump != NULL) {
+            continue;
+        }
+        // Statistics for a builtin are those of the shell while it runs
+        struct Process* proc = NULL;
+        struct rusage before;
+        if (job->timed || stats_log != NULL) {
+            proc = addProcess(job, 0, i, line->stages[i].argv[0]);
+            getrusage(RUSAGE_SELF, &before);
+        }
+
+        int ret = 1;
+        FILE* out = out_idx[i] == -1 ? stdout : fdopen(fds[out_idx[i]], "w");
+        if (out == NULL) {
+            close(fds[out_idx[i]]);
+        }
+        else {
+            ret = stage_builtins[i]->run(line->stages[i].argv, out);
+            if (out == stdout) {
+                fflush(stdout);
+            }
+            else {
+                fclose(out);
+            }
+        }
+
+        if (proc != NULL) {
+            struct rusage after;
+            getrusage(RUSAGE_SELF, &after);
+            proc->reaped = 1;
+            proc->wall = secondsSince(&proc->start);
+            proc->status = W_EXITCODE(ret & 0xff, 0);
+            timersub(&after.ru_utime, &before.ru_utime, &proc->usage.ru_utime);
+            timersub(&after.ru_stime, &before.ru_stime, &proc->usage.ru_stime);
+            proc->usage.ru_maxrss = after.ru_maxrss;
+            proc->usage.ru_nvcsw = after.ru_nvcsw - before.ru_nvcsw;
+            proc->usage.ru_nivcsw = after.ru_nivcsw - before.ru_nivcsw;
+            job->running--;
+        }
     }
 
-    // Parent  process will wait on child processes to finish 
+    // The line is done with once its pumps have finished
     for(int i = 0; i < n; i++) {
-        wait(NULL);
+        if (stage_builtins[i] == NULL || stage_builtins[i]->pump == NULL || pumps[i].builtin == NULL) {
+            continue;
+        }
+        // Only the thread a SIGINT lands on is interrupted, so once one has arrived it is
+        // passed on to the pump (again every PUMPPOLL, in case it came just before the
+        // pump blocked)
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        while (1) {
+            deadline.tv_nsec += PUMPPOLL;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            if (pthread_timedjoin_np(pumps[i].thread, NULL, &deadline) != ETIMEDOUT) {
+                break;
+            }
+            if (pumps_interrupted) {
+                pthread_kill(pumps[i].thread, SIGINT);
+            }
+        }
+        if (job->timed || stats_log != NULL) {
+            struct Process* proc = addProcess(job, 0, i, pumps[i].args[0]);
+            if (proc != NULL) {
+                proc->reaped = 1;
+                proc->wall = pumps[i].wall;
+                proc->status = W_EXITCODE(pumps[i].status & 0xff, 0);
+                proc->usage = pumps[i].usage;
+                job->running--;
+            }
+        }
+    }
+    if (npumps > 0) {
+        sigaction(SIGINT, &previous, NULL);
+        if (pumps_interrupted && interactive) {
+            printf("\n");
+        }
     }
 }
 
@@ -213,73 +1592,118 @@ void printDirectory() {
     }
 }
 
-void changeDir(char* path) {
-    if(chdir(path) != 0) {
-        perror("Failed to Change Directory : ");
-    }
-}
+int main(int argc, char* argv[]) {
+    char* buffer = NULL;          // User input buffer (grown by getline() as needed)
+    size_t buffer_size = 0;
+    FILE* input = stdin;          // Where command lines come from
+    int max_jobs = 1;             // Lines allowed to run at once
 
-
-int main() {
-    char buffer[BUFFERSIZE];      // User input buffer
-    char* commands[TOKENS];       // Command tokens 
-    int ret;                      // Monitor return values throughout program
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            char* endptr;
+            max_jobs = strtol(argv[++i], &endptr, 10);
+            if (*endptr != '\0' || max_jobs < 1 || max_jobs > MAXJOBS) {
+                printf("Error: -j Takes a Number of Jobs from 1 to %d\nProper Use:\n%s\n", MAXJOBS, USAGE);
+                exit(-1);
+            }
+        }
+        else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            stats_log = fopen(argv[++i], "ae");
+            if (stats_log == NULL) {
+                perror("Error Opening Stats Log : ");
+                exit(-1);
+            }
+        }
+        else if (input == stdin && argv[i][0] != '-') {
+            input = fopen(argv[i], "re");   // Not inherited by the commands run
+            if (input == NULL) {
+                perror("Error Opening Script : ");
+                exit(-1);
+            }
+            interactive = 0;
+        }
+        else {
+            printf("Error: Improper Command Line Arguments\nProper Use:\n%s\n", USAGE);
+            exit(-1);
+        }
+    }
 
     signal(2, ignoreSignal);
+    signal(SIGPIPE, SIG_IGN);     // Builtins writing to a closed pipe get EPIPE instead
+    signal(SIGCHLD, childExited);
 
     // Main loop:
     while(1) {
-        printDirectory();
+        reportJobs();
+        if (interactive) {
+            printDirectory();
+        }
 
-        // Obtain an input from the user
-        if (fgets(buffer, BUFFERSIZE, stdin) == NULL) {
-            printf("\n");
+        // Obtain an input from the user, and once it runs out wait for any jobs left
+        ssize_t len = getline(&buffer, &buffer_size, input);
+        if (len == -1) {
+            if (interactive) {
+                printf("\n");
+            }
+            waitAllJobs();
+            reportJobs();
+            free(buffer);
             return 0;
         }
+        if (len > 0 && buffer[len - 1] == '\n') {
+            buffer[--len] = 0;      // Truncate newline character from input
+        }
 
-        // Break the input into a set of tokens
-        buffer[strcspn(buffer, "\n")] = 0; // Truncate newline character from input
-        char* token = strtok(buffer, "("); 
-        int ind = 0;
-        commands[ind] = token;
+        // Parse the whole line into the arena before anything is run
+        arenaReset(&line_arena);
+        struct Pipeline* line = parseLine(&line_arena, buffer);
+        if (line == NULL || line->nstages == 0) {
+            continue;               // Simply move onto next loop to reprint command line to terminal 
+        }
 
-        while (token != NULL) {
-            token = strtok(NULL, "(");
-            ind++;
-            commands[ind] = token;
+        // "time" in front of a line is not a command of its own
+        int timed = strcmp(line->stages[0].argv[0], "time") == 0;
+        if (timed) {
+            line->stages[0].argv++;
+            if (--line->stages[0].argc == 0) {
+                printf("Error: Missing Command after time\n");
+                continue;
+            }
         }
 
-        // Built in command 'cd' support
-        if(strncmp(commands[0], "cd", 2) == 0) {
-            char* parsed_args[3];
-            rmvspace(commands[0],parsed_args);
-            changeDir(parsed_args[1]);
+        // With -j, commands that change the shell itself wait for the lines before them
+        char* name = line->stages[0].argv[0];
+        if (max_jobs > 1 && line->nstages == 1 && (strcmp(name, "cd") == 0 || strcmp(name, "hash") == 0)) {
+            waitParallelJobs();
         }
-        else {
-            // Command line execution w/o need for pipes 
-            if (ind == 1) {
-                char* parsed_args[10];
-                rmvspace(commands[0], parsed_args);
-                executeCommand(parsed_args);
-            }
-            // Command line exeuction w/ a single pipe present
-            else if(ind == 2) {
-                char* parsed_args[10];
-                rmvspace(commands[0], parsed_args);
-                char* parsed_pipe[10];
-                rmvspace(commands[1], parsed_pipe);
-                executePipe(parsed_args, parsed_pipe);
 
-            }
-            // Command line exeuction with a variable number of pipes (must deal with start, middle, and end processes);
-            else if(ind > 2 ) { 
-                execnpipes(commands, ind);
-            }
-            else { } // Simply move onto next loop to reprint command line to terminal 
+        // Lines run concurrently with -j (or '&') wait here for a free job
+        int concurrent = line->background || max_jobs > 1;
+        while (max_jobs > 1 && runningJobs() >= max_jobs && reapChild(0) != -1) { }
+        struct Job* job = newJob(buffer, line->background);
+        if (job == NULL) {
+            continue;
         }
+        job->parallel = max_jobs > 1 && !line->background;
+        job->timed = timed;
+
+        executePipeline(line, job);
 
+        if (!concurrent) {
+            waitJob(job);
+            finishJob(job);
+        }
+        else if (line->background && interactive) {
+            // Like other shells, give the process id of the last program in the pipeline
+            for (int i = job->nprocs - 1; i >= 0; i--) {
+                if (job->procs[i].pid != 0) {
+                    printf("[%d] %d\n", job->id, (int)job->procs[i].pid);
+                    break;
+                }
+            }
+        }
     }
 
 
     return 0;
-}
\ No newline at end of file
+}
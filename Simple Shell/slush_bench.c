@@ -0,0 +1,162 @@
+//SLUSH_BENCH - Command launch rate micro-benchmark for slush
+//
+//Usage:
+//slush_bench [commands] [slush binary ...]
+//
+//First times the two ways of launching a program, fork()+execvp() and posix_spawnp(),
+//by running "true" the given number of times from a parent holding 0 MB and then
+//BALLAST_MB MB of touched memory (fork() has to copy page tables for all of it).
+//Then, for each slush binary given, feeds it that many "/bin/true" lines on standard
+//input and reports the commands per second it sustains, so an old and a new build can
+//be compared directly (the full path bypasses both the builtin true and the command
+//hash, so every line launches a process). A second column does the same with plain
+//"true" lines, which a slush with builtins runs without launching anything. For example:
+//
+//./slush_bench 5000 ./slush_old ./slush
+//
+//Build with:
+//gcc -O2 -o slush_bench slush_bench.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <spawn.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define USAGE "slush_bench [commands] [slush binary ...]"
+#define BALLAST_MB 512
+
+extern char** environ;
+
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Launch "true" n times, one after the other, with fork()+execvp() or posix_spawnp()
+double launchRate(long n, int use_spawn) {
+    char* command[] = { "true", NULL };
+    double start = now();
+    for (long i = 0; i < n; i++) {
+        pid_t child;
+        if (use_spawn) {
+            int ret = posix_spawnp(&child, command[0], NULL, NULL, command, environ);
+            if (ret != 0) {
+                errno = ret;
+                perror("Error Spawning: ");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else {
+            child = fork();
+            if (child == -1) {
+                perror("Error Forking: ");
+                exit(EXIT_FAILURE);
+            }
+            if (child == 0) {
+                execvp(command[0], command);
+                _exit(127);
+            }
+        }
+        waitpid(child, NULL, 0);
+    }
+    return n / (now() - start);
+}
+
+// Run a slush binary with n copies of a command line on its standard input
+double slushRate(const char* slush, long n, const char* line) {
+    int pipefd[2];
+    if (pipe(pipefd) == -1) {
+        perror("Error Creating Pipe: ");
+        exit(EXIT_FAILURE);
+    }
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd == -1) {
+        perror("Error Opening /dev/null: ");
+        exit(EXIT_FAILURE);
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, pipefd[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, null_fd, STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&actions, pipefd[0]);
+    posix_spawn_file_actions_addclose(&actions, pipefd[1]);
+    posix_spawn_file_actions_addclose(&actions, null_fd);
+
+    char* command[] = { (char*)slush, NULL };
+    pid_t child;
+    double start = now();
+    int ret = posix_spawn(&child, slush, &actions, NULL, command, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(pipefd[0]);
+    close(null_fd);
+    if (ret != 0) {
+        errno = ret;
+        perror("Error Launching slush: ");
+        exit(EXIT_FAILURE);
+    }
+
+    FILE* input = fdopen(pipefd[1], "w");
+    for (long i = 0; i < n; i++) {
+        fputs(line, input);
+    }
+    fclose(input);
+    int status;
+    waitpid(child, &status, 0);
+    double elapsed = now() - start;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("Error: %s did not exit cleanly\n", slush);
+        exit(EXIT_FAILURE);
+    }
+    return n / elapsed;
+}
+
+
+int main(int argc, char* argv[]) {
+    long n = 2000;
+    if (argc > 1) {
+        char* endptr;
+        n = strtol(argv[1], &endptr, 10);
+        if (endptr == argv[1] || *endptr != '\0' || n <= 0) {
+            printf("Error: Command count must be a positive number\nProper Use:\n%s\n", USAGE);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("%-28s %16s %16s\n", "launch method", "commands/s", "commands/s");
+    printf("%-28s %16s %13d MB\n", "(parent memory)", "0 MB", BALLAST_MB);
+    double fork_rate = launchRate(n, 0);
+    double spawn_rate = launchRate(n, 1);
+
+    size_t ballast_len = (size_t)BALLAST_MB << 20;
+    char* ballast = malloc(ballast_len);
+    if (ballast == NULL) {
+        printf("Error: Unable to Allocate %d MB\n", BALLAST_MB);
+        exit(EXIT_FAILURE);
+    }
+    // Ordinary 4 KiB pages, like a heap built from many small allocations
+    madvise(ballast, ballast_len, MADV_NOHUGEPAGE);
+    memset(ballast, 1, ballast_len);
+    printf("%-28s %16.0f %16.0f\n", "fork + execvp", fork_rate, launchRate(n, 0));
+    printf("%-28s %16.0f %16.0f\n", "posix_spawnp", spawn_rate, launchRate(n, 1));
+    free(ballast);
+
+    if (argc > 2) {
+        printf("\n%-28s %16s %16s\n", "slush binary", "commands/s", "commands/s");
+        printf("%-28s %16s %16s\n", "(command line)", "/bin/true", "true");
+    }
+    for (int i = 2; i < argc; i++) {
+        double launch_rate = slushRate(argv[i], n, "/bin/true\n");
+        printf("%-28s %16.0f %16.0f\n", argv[i], launch_rate, slushRate(argv[i], n, "true\n"));
+    }
+    return 0;
+}